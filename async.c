@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "async.h"
+#include "tinyFS_errno.h"
+
+int tfs_error(int errnum);
+
+/* Requests submitted to one worker, oldest first */
+typedef struct {
+	request *head, *tail;
+	pthread_cond_t ready;
+} queue;
+
+pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+/* Each worker runs the requests of its own queue in order, and every
+request on a descriptor goes to the same queue, so they complete in the
+order they were submitted */
+queue submitted[ASYNC_WORKERS];
+/* Completed requests, oldest first */
+request *doneHead = NULL, *doneTail = NULL;
+int nextID = 0;
+int nWorkers = 0;
+int eventFD = -1;
+void (*runRequest)(request*) = NULL;
+
+static void push(request** head, request** tail, request* r) {
+	r->next = NULL;
+	if (*tail) {
+		(*tail)->next = r;
+	} else {
+		*head = r;
+	}
+	*tail = r;
+}
+
+static request* pop(request** head, request** tail) {
+	request* r = *head;
+	if (r) {
+		*head = r->next;
+		if (*head == NULL) {
+			*tail = NULL;
+		}
+	}
+	return r;
+}
+
+static void* worker(void* arg) {
+	queue* q = arg;
+	pthread_mutex_lock(&asyncLock);
+	for (;;) {
+		request* r;
+		while ((r = pop(&q->head, &q->tail)) == NULL) {
+			pthread_cond_wait(&q->ready, &asyncLock);
+		}
+		pthread_mutex_unlock(&asyncLock);
+		runRequest(r);
+		pthread_mutex_lock(&asyncLock);
+		push(&doneHead, &doneTail, r);
+		// Can only fail when the counter is full, which is readable anyway
+		uint64_t one = 1;
+		ssize_t n = write(eventFD, &one, sizeof(one));
+		(void) n;
+	}
+	return NULL;
+}
+
+int async_start(int workers, void (*run)(request*)) {
+	int err = 0;
+	pthread_mutex_lock(&asyncLock);
+	if (eventFD < 0 && (eventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		err = tfs_error(errno);
+	}
+	runRequest = run;
+	if (workers > ASYNC_WORKERS) {
+		workers = ASYNC_WORKERS;
+	}
+	while (err == 0 && nWorkers < workers) {
+		pthread_t t;
+		queue* q = &submitted[nWorkers];
+		pthread_cond_init(&q->ready, NULL);
+		if ((errno = pthread_create(&t, NULL, worker, q)) != 0) {
+			err = nWorkers ? 0 : tfs_error(errno);
+			break;
+		}
+		pthread_detach(t);
+		nWorkers++;
+	}
+	pthread_mutex_unlock(&asyncLock);
+	return err;
+}
+
+int async_submit(int op, int fd, void* buf, int len, int offset, void* userData) {
+	request* r = malloc(sizeof(request));
+	if (r == NULL) {
+		return ERR_NOMEMORY;
+	}
+	r->ev.op = op;
+	r->ev.fd = fd;
+	r->ev.res = 0;
+	r->ev.userData = userData;
+	r->buf = buf;
+	r->len = len;
+	r->offset = offset;
+	pthread_mutex_lock(&asyncLock);
+	r->ev.id = nextID;
+	nextID = (nextID == INT32_MAX) ? 0 : nextID + 1;
+	int id = r->ev.id;
+	// Opens have no descriptor yet and may go to any worker
+	queue* q = &submitted[(fd >= 0 ? fd : id) % nWorkers];
+	push(&q->head, &q->tail, r);
+	pthread_cond_signal(&q->ready);
+	pthread_mutex_unlock(&asyncLock);
+	return id;
+}
+
+int async_reap(struct tfs_event* events, int max) {
+	int n = 0;
+	pthread_mutex_lock(&asyncLock);
+	request* r;
+	while (n < max && (r = pop(&doneHead, &doneTail))) {
+		events[n++] = r->ev;
+		free(r);
+	}
+	if (doneHead == NULL && eventFD >= 0) {
+		// Nothing left to reap, reset the counter
+		uint64_t count;
+		ssize_t n = read(eventFD, &count, sizeof(count));
+		(void) n;
+	}
+	pthread_mutex_unlock(&asyncLock);
+	return n;
+}
+
+int async_fd(void) {
+	return eventFD;
+}
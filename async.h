@@ -0,0 +1,31 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "tinyFS_async.h"
+
+/* Queues of submitted requests serviced by a pool of worker threads,
+one per worker, and queue of their completions. Requests on the same
+descriptor always go to the same worker. */
+
+#define ASYNC_WORKERS 4
+
+typedef struct request {
+	struct tfs_event ev;
+	void* buf;
+	int len, offset;
+	struct request* next;
+} request;
+
+/* Start the workers if they are not running, at most ASYNC_WORKERS,
+each request is passed to run which must set ev.res */
+int async_start(int workers, void (*run)(request*));
+
+/* Queue a request, returns its id */
+int async_submit(int op, int fd, void* buf, int len, int offset, void* userData);
+int async_reap(struct tfs_event* events, int max);
+
+/* Readable while completions are waiting to be reaped */
+int async_fd(void);
+
+//ASYNC_H
+#endif
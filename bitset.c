@@ -88,3 +88,23 @@ int bitset_popcnt(uint8_t* set, int size) {
 	}
 	return sum + __builtin_popcount(word);
 }
+
+int bitset_find_run(uint8_t* set, int size, int len) {
+	int run = 0;
+	for (int i = 0; i < size; i++) {
+		if ((i & 7) == 0 && set[i>>3] == 0) {
+			// Skip a byte with no set bits
+			run = 0;
+			i += 7;
+			continue;
+		}
+		if (set[i>>3] & (1<<(i&7))) {
+			if (++run == len) {
+				return i - len + 1;
+			}
+		} else {
+			run = 0;
+		}
+	}
+	return -1;
+}
@@ -17,5 +17,8 @@ int bitset_next_set(uint8_t* set, int size, int idx);
 
 int bitset_popcnt(uint8_t* set, int size);
 
+/* First index of len consecutive set bits, -1 if there are none */
+int bitset_find_run(uint8_t* set, int size, int len);
+
 //BITSET_H
 #endif
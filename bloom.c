@@ -0,0 +1,53 @@
+#include <limits.h>
+#include <string.h>
+
+#include "bloom.h"
+
+/* Counter indices of key, by double hashing two FNV-1a variants */
+static void indices(const char* key, int len, int* idx) {
+	uint32_t h1 = 2166136261u, h2 = 5381;
+	for (int i = 0; i < len; i++) {
+		h1 ^= (uint8_t) key[i];
+		h1 *= 16777619u;
+		h2 = h2 * 33 + (uint8_t) key[i];
+	}
+	h2 |= 1;
+	for (int i = 0; i < BLOOM_HASHES; i++) {
+		idx[i] = (h1 + i * h2) % BLOOM_SIZE;
+	}
+}
+
+void bloom_reset(bloom_t* f) {
+	memset(f->counts, 0, sizeof(f->counts));
+}
+
+void bloom_add(bloom_t* f, const char* key, int len) {
+	int idx[BLOOM_HASHES];
+	indices(key, len, idx);
+	for (int i = 0; i < BLOOM_HASHES; i++) {
+		if (f->counts[idx[i]] < UCHAR_MAX) {
+			f->counts[idx[i]]++;
+		}
+	}
+}
+
+void bloom_remove(bloom_t* f, const char* key, int len) {
+	int idx[BLOOM_HASHES];
+	indices(key, len, idx);
+	for (int i = 0; i < BLOOM_HASHES; i++) {
+		if (f->counts[idx[i]] > 0 && f->counts[idx[i]] < UCHAR_MAX) {
+			f->counts[idx[i]]--;
+		}
+	}
+}
+
+int bloom_maybe(const bloom_t* f, const char* key, int len) {
+	int idx[BLOOM_HASHES];
+	indices(key, len, idx);
+	for (int i = 0; i < BLOOM_HASHES; i++) {
+		if (f->counts[idx[i]] == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,26 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+
+/* Counting Bloom filter over short keys. Each key bumps BLOOM_HASHES of
+the counters, so keys can be removed again. A counter that saturates is
+never decremented, leaving the filter conservative. bloom_maybe returning
+0 means the key was definitely never added (or has been removed). */
+
+#define BLOOM_SIZE 256
+#define BLOOM_HASHES 3
+
+typedef struct {
+	uint8_t counts[BLOOM_SIZE];
+} bloom_t;
+
+void bloom_reset(bloom_t* f);
+
+void bloom_add(bloom_t* f, const char* key, int len);
+void bloom_remove(bloom_t* f, const char* key, int len);
+
+int bloom_maybe(const bloom_t* f, const char* key, int len);
+
+//BLOOM_H
+#endif
@@ -0,0 +1,190 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "cache.h"
+#include "tinyFS.h"
+
+#define CACHE_BUCKETS 64
+
+typedef struct entry {
+	/* disk is -1 for a free slot, or a pinned copy that was detached */
+	int disk, bNum;
+	int pins;
+	/* LRU list of every slot, most recently used first */
+	struct entry *prev, *next;
+	/* Bucket chain of cached blocks */
+	struct entry* hnext;
+	uint8_t data[BLOCKSIZE];
+} entry;
+
+entry cacheSlots[CACHE_BLOCKS];
+entry* cacheBuckets[CACHE_BUCKETS];
+entry *cacheLRU = NULL, *cacheTail = NULL;
+int cacheReady = 0;
+
+static void init(void) {
+	for (int i = 0; i < CACHE_BLOCKS; i++) {
+		cacheSlots[i].disk = -1;
+		cacheSlots[i].prev = (i > 0) ? &cacheSlots[i-1] : NULL;
+		cacheSlots[i].next = (i+1 < CACHE_BLOCKS) ? &cacheSlots[i+1] : NULL;
+	}
+	cacheLRU = &cacheSlots[0];
+	cacheTail = &cacheSlots[CACHE_BLOCKS-1];
+	cacheReady = 1;
+}
+
+static inline int bucket(int disk, int bNum) {
+	return (unsigned) (bNum * 31 + disk) % CACHE_BUCKETS;
+}
+
+static entry* find(int disk, int bNum) {
+	for (entry* e = cacheBuckets[bucket(disk, bNum)]; e; e = e->hnext) {
+		if (e->disk == disk && e->bNum == bNum) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void unhash(entry* e) {
+	entry** pp = &cacheBuckets[bucket(e->disk, e->bNum)];
+	while (*pp != e) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+	e->disk = -1;
+}
+
+static void unlist(entry* e) {
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		cacheLRU = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		cacheTail = e->prev;
+	}
+}
+
+/* Make e the most recently used slot */
+static void touch(entry* e) {
+	if (cacheLRU == e) {
+		return;
+	}
+	unlist(e);
+	e->prev = NULL;
+	e->next = cacheLRU;
+	cacheLRU->prev = e;
+	cacheLRU = e;
+}
+
+/* Make e the first slot to be reused */
+static void retire(entry* e) {
+	if (cacheTail == e) {
+		return;
+	}
+	unlist(e);
+	e->next = NULL;
+	e->prev = cacheTail;
+	cacheTail->next = e;
+	cacheTail = e;
+}
+
+/* Slot whose data data points into */
+static entry* fromData(const uint8_t* data) {
+	ptrdiff_t off = (const char*) data - (const char*) cacheSlots;
+	if (off < 0 || off >= (ptrdiff_t) sizeof(cacheSlots)) {
+		return NULL;
+	}
+	entry* e = &cacheSlots[off / sizeof(entry)];
+	return (data >= e->data && data < e->data + BLOCKSIZE) ? e : NULL;
+}
+
+uint8_t* cache_get(int disk, int bNum) {
+	if (!cacheReady) {
+		init();
+	}
+	entry* e = find(disk, bNum);
+	if (e == NULL) {
+		return NULL;
+	}
+	touch(e);
+	return e->data;
+}
+
+uint8_t* cache_put(int disk, int bNum, const uint8_t* data, int size) {
+	if (!cacheReady) {
+		init();
+	}
+	entry* e = find(disk, bNum);
+	if (e && e->pins > 0) {
+		// Readers keep the old contents
+		unhash(e);
+		e = NULL;
+	}
+	if (e == NULL) {
+		// Take the least recently used unpinned slot
+		for (e = cacheTail; e && e->pins > 0; e = e->prev);
+		if (e == NULL) {
+			return NULL;
+		}
+		if (e->disk >= 0) {
+			unhash(e);
+		}
+		e->disk = disk;
+		e->bNum = bNum;
+		int b = bucket(disk, bNum);
+		e->hnext = cacheBuckets[b];
+		cacheBuckets[b] = e;
+	}
+	memcpy(e->data, data, size);
+	touch(e);
+	return e->data;
+}
+
+void cache_pin(uint8_t* data) {
+	entry* e = fromData(data);
+	if (e) {
+		e->pins++;
+	}
+}
+
+int cache_unpin(const uint8_t* data) {
+	entry* e = fromData(data);
+	if (e == NULL || e->pins <= 0) {
+		return -1;
+	}
+	if (--e->pins == 0 && e->disk < 0) {
+		retire(e);
+	}
+	return 0;
+}
+
+void cache_forget(int disk, int bNum) {
+	if (!cacheReady) {
+		return;
+	}
+	entry* e = find(disk, bNum);
+	if (e) {
+		unhash(e);
+		if (e->pins == 0) {
+			retire(e);
+		}
+	}
+}
+
+void cache_drop(int disk) {
+	if (!cacheReady) {
+		return;
+	}
+	for (int i = 0; i < CACHE_BLOCKS; i++) {
+		if (cacheSlots[i].disk == disk) {
+			unhash(&cacheSlots[i]);
+			if (cacheSlots[i].pins == 0) {
+				retire(&cacheSlots[i]);
+			}
+		}
+	}
+}
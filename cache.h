@@ -0,0 +1,31 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+/* LRU cache of disk blocks keyed by disk and block number. Cached blocks
+can be pinned, which holds them against eviction and against being
+changed: writing a pinned block detaches the pinned copy, which lives on
+unchanged until it is unpinned, and caches the new contents separately. */
+
+#define CACHE_BLOCKS 64
+
+/* Cached contents of the block, NULL if it is not cached */
+uint8_t* cache_get(int disk, int bNum);
+/* Cache a copy of data as the block's contents, returns the cached copy or
+NULL if every slot is pinned */
+uint8_t* cache_put(int disk, int bNum, const uint8_t* data, int size);
+
+/* data may point anywhere into a block returned by cache_get or cache_put */
+void cache_pin(uint8_t* data);
+/* Returns -1 if data does not point into a pinned block */
+int cache_unpin(const uint8_t* data);
+
+/* Forget the block, a pinned copy stays valid until unpinned */
+void cache_forget(int disk, int bNum);
+
+/* Forget every block of disk, pinned ones stay valid until unpinned */
+void cache_drop(int disk);
+
+//CACHE_H
+#endif
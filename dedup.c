@@ -0,0 +1,70 @@
+#include <limits.h>
+#include <string.h>
+
+#include "dedup.h"
+
+#define DEDUP_BUCKETS 64
+#define DEDUP_MAX_BLOCKS (UCHAR_MAX+1)
+
+/* Head of each bucket, 0 is the end of a list since block 0 is always
+the superblock and is never indexed */
+uint8_t buckets[DEDUP_BUCKETS];
+uint8_t bucketNext[DEDUP_MAX_BLOCKS];
+uint32_t blockHash[DEDUP_MAX_BLOCKS];
+uint8_t indexed[DEDUP_MAX_BLOCKS];
+
+/* FNV-1a */
+uint32_t dedup_hash(uint8_t* data, int size) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void dedup_reset(void) {
+	memset(buckets, 0, sizeof(buckets));
+	memset(indexed, 0, sizeof(indexed));
+}
+
+void dedup_insert(int bNum, uint32_t hash) {
+	if (bNum <= 0 || bNum >= DEDUP_MAX_BLOCKS) {
+		return;
+	}
+	dedup_remove(bNum);
+	int b = hash % DEDUP_BUCKETS;
+	blockHash[bNum] = hash;
+	bucketNext[bNum] = buckets[b];
+	buckets[b] = bNum;
+	indexed[bNum] = 1;
+}
+
+void dedup_remove(int bNum) {
+	if (bNum <= 0 || bNum >= DEDUP_MAX_BLOCKS || !indexed[bNum]) {
+		return;
+	}
+	uint8_t* link = &buckets[blockHash[bNum] % DEDUP_BUCKETS];
+	while (*link && *link != bNum) {
+		link = &bucketNext[*link];
+	}
+	*link = bucketNext[bNum];
+	indexed[bNum] = 0;
+}
+
+int dedup_first(uint32_t hash) {
+	int bNum = buckets[hash % DEDUP_BUCKETS];
+	while (bNum && blockHash[bNum] != hash) {
+		bNum = bucketNext[bNum];
+	}
+	return bNum;
+}
+
+int dedup_next(int bNum) {
+	uint32_t hash = blockHash[bNum];
+	bNum = bucketNext[bNum];
+	while (bNum && blockHash[bNum] != hash) {
+		bNum = bucketNext[bNum];
+	}
+	return bNum;
+}
@@ -0,0 +1,22 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+/* Fingerprint index over block images. Blocks are linked into buckets
+by their block number, so the index needs no allocation and a block can
+be dropped from it in O(bucket). Lookups only return candidates, the
+caller must compare the block contents before sharing a block. */
+
+uint32_t dedup_hash(uint8_t* data, int size);
+
+void dedup_reset(void);
+
+void dedup_insert(int bNum, uint32_t hash);
+void dedup_remove(int bNum);
+
+int dedup_first(uint32_t hash);
+int dedup_next(int bNum);
+
+//DEDUP_H
+#endif
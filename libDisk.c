@@ -1,33 +1,220 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #ifdef DEBUG_FLAG
 	#include <stdio.h>
-	#include <string.h>
 #endif
 
 #include "libDisk.h"
 #include "tinyFS.h"
+#include "cache.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Most blocks written by one call when flushing held writes */
+#define FLUSH_RUN 64
+
+/* Unit of every transfer to a disk opened with DISK_DIRECT, a multiple
+of the logical sector size of any device we run on */
+#define DIRECT_ALIGN 4096
+/* Aligned buffers kept for reuse */
+#define DIRECT_BUFFERS 8
+
+/* Disk names selecting a RAM disk */
+#define MEM_PREFIX "mem:"
+/* Disk number of the first RAM disk, above any file descriptor */
+#define MEM_DISK_BASE (1 << 24)
 
 int tfs_error(int errnum);
 
+/* Disk whose writes are being held by bufferWrites, and the held block
+images indexed by block number */
+int heldDisk = -1;
+uint8_t** held = NULL;
+int nHeld = 0;
+
+/* Whether each disk, by number, was opened with DISK_DIRECT */
+uint8_t* direct = NULL;
+int nDirect = 0;
+
+/* Free aligned buffers for direct transfers */
+void* directPool[DIRECT_BUFFERS];
+int nDirectPool = 0;
+
+/* RAM disks, by disk number less MEM_DISK_BASE. A RAM disk outlives
+closeDisk, so it can be formatted, then mounted, until the process ends. */
+typedef struct {
+	char* name;
+	uint8_t* data;
+	int size;
+	int opens;
+} memDisk;
+
+memDisk* memDisks = NULL;
+int nMemDisks = 0;
+
+static inline memDisk* getMemDisk(int disk) {
+	disk -= MEM_DISK_BASE;
+	return (disk >= 0 && disk < nMemDisks) ? &memDisks[disk] : NULL;
+}
+
+static memDisk* findMemDisk(char* name, int create) {
+	for (int i = 0; i < nMemDisks; i++) {
+		if (strcmp(memDisks[i].name, name) == 0) {
+			return &memDisks[i];
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	memDisk* tmp = realloc(memDisks, (nMemDisks + 1) * sizeof(memDisk));
+	if (tmp == NULL) {
+		return NULL;
+	}
+	memDisks = tmp;
+	memDisk* m = &memDisks[nMemDisks];
+	if ((m->name = strdup(name)) == NULL) {
+		return NULL;
+	}
+	m->data = NULL;
+	m->size = 0;
+	m->opens = 0;
+	nMemDisks++;
+	return m;
+}
+
+/* Grow or shrink the buffer of m to size bytes, zeroing any new bytes */
+static int sizeMemDisk(memDisk* m, int size) {
+	uint8_t* tmp = realloc(m->data, size);
+	if (tmp == NULL) {
+		return ERR_NOMEMORY;
+	}
+	if (size > m->size) {
+		memset(tmp + m->size, 0, size - m->size);
+	}
+	m->data = tmp;
+	m->size = size;
+	return 0;
+}
+
+static int openMemDisk(char* filename, int nBytes) {
+	memDisk* m = findMemDisk(filename, nBytes != 0);
+	if (m == NULL) {
+		return (nBytes != 0) ? ERR_NOMEMORY : tfs_error(ENOENT);
+	}
+	if (nBytes != 0) {
+		int err = sizeMemDisk(m, nBytes);
+		if (err < 0) {
+			return err;
+		}
+	}
+	m->opens++;
+	return MEM_DISK_BASE + (int) (m - memDisks);
+}
+
+/* Size in bytes of the disk */
+static off_t diskSize(int disk) {
+	memDisk* m = getMemDisk(disk);
+	if (m) {
+		return m->size;
+	}
+	off_t size = lseek(disk, 0, SEEK_END);
+	return (size == (off_t) -1) ? tfs_error(errno) : size;
+}
+
+static inline int isDirect(int disk) {
+	return disk < nDirect && direct[disk];
+}
+
+static int setDirect(int disk, int on) {
+	if (disk >= nDirect) {
+		if (!on) {
+			return 0;
+		}
+		int n = nDirect ? nDirect : 16;
+		while (n <= disk) {
+			n *= 2;
+		}
+		uint8_t* tmp = realloc(direct, n);
+		if (tmp == NULL) {
+			return ERR_NOMEMORY;
+		}
+		memset(tmp + nDirect, 0, n - nDirect);
+		direct = tmp;
+		nDirect = n;
+	}
+	direct[disk] = on;
+	return 0;
+}
+
+static void* getAligned(void) {
+	void* buf;
+	if (nDirectPool > 0) {
+		return directPool[--nDirectPool];
+	}
+	if (posix_memalign(&buf, DIRECT_ALIGN, DIRECT_ALIGN) != 0) {
+		return NULL;
+	}
+	return buf;
+}
+
+static void putAligned(void* buf) {
+	if (nDirectPool < DIRECT_BUFFERS) {
+		directPool[nDirectPool++] = buf;
+	} else {
+		free(buf);
+	}
+}
+
 int openDisk(char* filename, int nBytes) {
-	int fd, flags = O_RDWR;
+	return openDiskFlags(filename, nBytes, 0);
+}
+
+int openDiskFlags(char* filename, int nBytes, int diskFlags) {
+	int fd, err, flags = O_RDWR;
 	if (nBytes != 0) {
 		if (nBytes < BLOCKSIZE) {
 			return ERR_INVALID;
 		}
+		nBytes = (nBytes / BLOCKSIZE) * BLOCKSIZE;
 		flags |= O_CREAT;
 	}
+	if (strncmp(filename, MEM_PREFIX, strlen(MEM_PREFIX)) == 0) {
+		// Already in memory, DISK_DIRECT has nothing to bypass
+		return openMemDisk(filename, nBytes);
+	}
+	if (diskFlags & DISK_DIRECT) {
+		if (nBytes % DIRECT_ALIGN != 0) {
+			return ERR_INVALID;
+		}
+		flags |= O_DIRECT;
+	}
 	if ((fd = open(filename, flags, 0666)) == -1) {
 		return tfs_error(errno);
 	}
 	if (nBytes == 0) {
-		return fd;
+		struct stat st;
+		if (fstat(fd, &st) == -1) {
+			err = tfs_error(errno);
+			close(fd);
+			return err;
+		} else if ((diskFlags & DISK_DIRECT) && st.st_size % DIRECT_ALIGN != 0) {
+			close(fd);
+			return ERR_INVALID;
+		}
+	} else if (ftruncate(fd, nBytes) == -1) {
+		err = tfs_error(errno);
+		close(fd);
+		return err;
 	}
-	nBytes = (nBytes / BLOCKSIZE) * BLOCKSIZE;
-	if (ftruncate(fd, nBytes) == -1) {
-		int err = tfs_error(errno);
+	if ((err = setDirect(fd, (diskFlags & DISK_DIRECT) != 0)) < 0) {
 		close(fd);
 		return err;
 	}
@@ -38,6 +225,19 @@ int openDisk(char* filename, int nBytes) {
 }
 
 int closeDisk(int disk) {
+	if (disk == heldDisk) {
+		int err = flushWrites(disk);
+		if (err < 0) {
+			return err;
+		}
+	}
+	cache_drop(disk);
+	memDisk* m = getMemDisk(disk);
+	if (m) {
+		m->opens--;
+		return 0;
+	}
+	setDirect(disk, 0);
 	if (close(disk) == -1) {
 		return tfs_error(errno);
 	}
@@ -47,42 +247,411 @@ int closeDisk(int disk) {
 	return 0;
 }
 
+int resizeDisk(int disk, int nBytes) {
+	if (nBytes < BLOCKSIZE) {
+		return ERR_INVALID;
+	}
+	nBytes = (nBytes / BLOCKSIZE) * BLOCKSIZE;
+	if (isDirect(disk) && nBytes % DIRECT_ALIGN != 0) {
+		return ERR_INVALID;
+	}
+	off_t size = diskSize(disk);
+	if (size < 0) {
+		return size;
+	}
+	if (nBytes < size && disk == heldDisk) {
+		// Held blocks past the new end could not be written out
+		return ERR_TXTBUSY;
+	}
+	memDisk* m = getMemDisk(disk);
+	if (m) {
+		int err = sizeMemDisk(m, nBytes);
+		if (err < 0) {
+			return err;
+		}
+	} else if (ftruncate(disk, nBytes) == -1) {
+		return tfs_error(errno);
+	}
+	if (nBytes < size) {
+		cache_drop(disk);
+	}
+	return 0;
+}
+
 int log2phys(int disk, int bNum) {
 	int off = bNum * BLOCKSIZE;
-	int size = lseek(disk, 0, SEEK_END);
-	if (size == (off_t) -1) {
-		return tfs_error(errno);
+	off_t size = diskSize(disk);
+	if (size < 0) {
+		return size;
 	} else if (size < off+BLOCKSIZE) {
 		return ERR_INVALID;
 	}
 	return off;
 }
 
+/* Read the block at byte off of a direct disk, through the aligned
+buffer holding the whole transfer unit around it */
+static int directRead(int disk, void* block, off_t off) {
+	uint8_t* buf = getAligned();
+	if (buf == NULL) {
+		return ERR_NOMEMORY;
+	}
+	off_t unit = off & ~(off_t) (DIRECT_ALIGN-1);
+	ssize_t r = pread(disk, buf, DIRECT_ALIGN, unit);
+	int err = (r == -1) ? tfs_error(errno) : (r < DIRECT_ALIGN) ? ERR_IO : 0;
+	if (err == 0) {
+		memcpy(block, buf + (off - unit), BLOCKSIZE);
+	}
+	putAligned(buf);
+	return err;
+}
+
+/* Write the concatenation of iov at byte off of a direct disk, one
+aligned transfer unit at a time, reading in units it only partly covers */
+static int directWrite(int disk, const struct iovec* iov, int iovcnt, off_t off) {
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	uint8_t* buf = getAligned();
+	if (buf == NULL) {
+		return ERR_NOMEMORY;
+	}
+	int err = 0, i = 0;
+	size_t skip = 0;
+	off_t unit = off & ~(off_t) (DIRECT_ALIGN-1);
+	for (; err == 0 && unit < off + (off_t) len; unit += DIRECT_ALIGN) {
+		off_t lo = (unit > off) ? unit : off;
+		off_t hi = (unit + DIRECT_ALIGN < off + (off_t) len) ? unit + DIRECT_ALIGN : off + (off_t) len;
+		if (hi - lo < DIRECT_ALIGN) {
+			ssize_t r = pread(disk, buf, DIRECT_ALIGN, unit);
+			if (r < DIRECT_ALIGN) {
+				err = (r == -1) ? tfs_error(errno) : ERR_IO;
+				break;
+			}
+		}
+		// Copy the part of iov that lands in this unit
+		for (off_t pos = lo; pos < hi; ) {
+			size_t n = iov[i].iov_len - skip;
+			if (n > (size_t) (hi - pos)) {
+				n = hi - pos;
+			}
+			memcpy(buf + (pos - unit), (uint8_t*) iov[i].iov_base + skip, n);
+			pos += n;
+			skip += n;
+			if (skip == iov[i].iov_len) {
+				i++;
+				skip = 0;
+			}
+		}
+		ssize_t w = pwrite(disk, buf, DIRECT_ALIGN, unit);
+		if (w < DIRECT_ALIGN) {
+			err = (w == -1) ? tfs_error(errno) : ERR_IO;
+		}
+	}
+	putAligned(buf);
+	return err;
+}
+
+/* Write the concatenation of iov at byte off with one system call, or
+through aligned buffers on a direct disk */
+static int writeAt(int disk, const struct iovec* iov, int iovcnt, off_t off) {
+	memDisk* m = getMemDisk(disk);
+	if (m) {
+		for (int i = 0; i < iovcnt; i++) {
+			memcpy(m->data + off, iov[i].iov_base, iov[i].iov_len);
+			off += iov[i].iov_len;
+		}
+		return 0;
+	} else if (isDirect(disk)) {
+		return directWrite(disk, iov, iovcnt, off);
+	}
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	ssize_t w = pwritev(disk, iov, iovcnt, off);
+	if (w == -1) {
+		return tfs_error(errno);
+	} else if ((size_t) w < len) {
+		return ERR_IO;
+	}
+	return 0;
+}
+
 int readBlock(int disk, int bNum, void* block) {
+	uint8_t* data = cache_get(disk, bNum);
+	if (data) {
+		memcpy(block, data, BLOCKSIZE);
+		stats_add(cacheHits, 1);
+		trace(TFS_TRACE_READ_BLOCK, trace_now(), bNum, disk, BLOCKSIZE, 0);
+		return 0;
+	}
+	if (disk == heldDisk && bNum < nHeld && held[bNum]) {
+		memcpy(block, held[bNum], BLOCKSIZE);
+		cache_put(disk, bNum, block, BLOCKSIZE);
+		stats_add(cacheHits, 1);
+		trace(TFS_TRACE_READ_BLOCK, trace_now(), bNum, disk, BLOCKSIZE, 0);
+		return 0;
+	}
 	int off = log2phys(disk, bNum);
 	if (off < 0) {
 		return off;
 	}
-	if (pread(disk, block, BLOCKSIZE, off) == -1) {
+	memDisk* m = getMemDisk(disk);
+	if (m) {
+		memcpy(block, m->data + off, BLOCKSIZE);
+	} else if (isDirect(disk)) {
+		int err = directRead(disk, block, off);
+		if (err < 0) {
+			return err;
+		}
+	} else if (pread(disk, block, BLOCKSIZE, off) == -1) {
 		return tfs_error(errno);
 	}
+	cache_put(disk, bNum, block, BLOCKSIZE);
+	stats_add(cacheMisses, 1);
+	stats_add(blockReads, 1);
+	trace(TFS_TRACE_READ_BLOCK, trace_now(), bNum, disk, BLOCKSIZE, 0);
 #ifdef DEBUG_FLAG
 	printf("Read Block #%d\n\tType: %d\n", bNum, *(char*)block);
 #endif
 	return 0;
 }
 
+/* Hold a copy of block until flushWrites */
+static int holdBlock(int bNum, void* block) {
+	if (bNum >= nHeld) {
+		int n = nHeld ? nHeld : 64;
+		while (n <= bNum) {
+			n *= 2;
+		}
+		uint8_t** tmp = realloc(held, n * sizeof(uint8_t*));
+		if (tmp == NULL) {
+			return ERR_NOMEMORY;
+		}
+		memset(tmp + nHeld, 0, (n - nHeld) * sizeof(uint8_t*));
+		held = tmp;
+		nHeld = n;
+	}
+	if (held[bNum] == NULL && (held[bNum] = malloc(BLOCKSIZE)) == NULL) {
+		return ERR_NOMEMORY;
+	}
+	memcpy(held[bNum], block, BLOCKSIZE);
+	return 0;
+}
+
 int writeBlock(int disk, int bNum, void* block) {
 	int off = log2phys(disk, bNum);
 	if (off < 0) {
 		return off;
 	}
-	if (pwrite(disk, block, BLOCKSIZE, off) == -1) {
+	if (disk == heldDisk) {
+		int err = holdBlock(bNum, block);
+		if (err < 0) {
+			return err;
+		}
+		cache_put(disk, bNum, block, BLOCKSIZE);
+		trace(TFS_TRACE_WRITE_BLOCK, trace_now(), bNum, disk, BLOCKSIZE, 0);
+		return 0;
+	}
+	struct iovec iov = {block, BLOCKSIZE};
+	int err = writeAt(disk, &iov, 1, off);
+	if (err < 0) {
+		return err;
+	}
+	cache_put(disk, bNum, block, BLOCKSIZE);
+	stats_add(blockWrites, 1);
+	trace(TFS_TRACE_WRITE_BLOCK, trace_now(), bNum, disk, BLOCKSIZE, 0);
+	return 0;
+}
+
+int writeBlocks(int disk, int bNum, int n, void* blocks) {
+	if (n <= 0) {
+		return (n == 0) ? 0 : ERR_INVALID;
+	}
+	int off = log2phys(disk, bNum + n - 1);
+	if (off < 0) {
+		return off;
+	}
+	off = bNum * BLOCKSIZE;
+	if (disk == heldDisk) {
+		for (int i = 0; i < n; i++) {
+			int err = writeBlock(disk, bNum + i, (uint8_t*) blocks + i * BLOCKSIZE);
+			if (err < 0) {
+				return err;
+			}
+		}
+		return 0;
+	}
+	struct iovec iov = {blocks, n * BLOCKSIZE};
+	int err = writeAt(disk, &iov, 1, off);
+	if (err < 0) {
+		return err;
+	}
+	for (int i = 0; i < n; i++) {
+		cache_put(disk, bNum + i, (uint8_t*) blocks + i * BLOCKSIZE, BLOCKSIZE);
+		trace(TFS_TRACE_WRITE_BLOCK, trace_now(), bNum + i, disk, BLOCKSIZE, 0);
+	}
+	stats_add(blockWrites, n);
+	return 0;
+}
+
+int discardBlocks(int disk, int bNum, int n) {
+	if (n <= 0) {
+		return (n == 0) ? 0 : ERR_INVALID;
+	}
+	int off = log2phys(disk, bNum + n - 1);
+	if (off < 0) {
+		return off;
+	}
+	for (int i = bNum; i < bNum + n; i++) {
+		cache_forget(disk, i);
+		if (disk == heldDisk && i < nHeld && held[i]) {
+			free(held[i]);
+			held[i] = NULL;
+		}
+	}
+	memDisk* m = getMemDisk(disk);
+	if (m) {
+		memset(m->data + bNum * BLOCKSIZE, 0, n * BLOCKSIZE);
+	} else if (fallocate(disk, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(off_t) bNum * BLOCKSIZE, (off_t) n * BLOCKSIZE) == -1) {
 		return tfs_error(errno);
 	}
 	return 0;
 }
 
+int saveDisk(int disk, char* filename) {
+	memDisk* m = getMemDisk(disk);
+	if (m == NULL) {
+		return ERR_INVALID;
+	} else if (disk == heldDisk) {
+		// The image would miss the held writes
+		return ERR_TXTBUSY;
+	}
+	int err = 0, fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		return tfs_error(errno);
+	}
+	for (int done = 0; done < m->size; ) {
+		ssize_t w = write(fd, m->data + done, m->size - done);
+		if (w == -1) {
+			err = tfs_error(errno);
+			close(fd);
+			return err;
+		}
+		done += w;
+	}
+	if (close(fd) == -1) {
+		return tfs_error(errno);
+	}
+	return 0;
+}
+
+int loadDisk(char* filename, char* diskname) {
+	if (strncmp(diskname, MEM_PREFIX, strlen(MEM_PREFIX)) != 0) {
+		return ERR_INVALID;
+	}
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return tfs_error(errno);
+	}
+	int err = 0;
+	struct stat st;
+	memDisk* m = findMemDisk(diskname, 1);
+	if (fstat(fd, &st) == -1) {
+		err = tfs_error(errno);
+	} else if (st.st_size < BLOCKSIZE || st.st_size > INT_MAX) {
+		err = ERR_INVALID;
+	} else if (m == NULL) {
+		err = ERR_NOMEMORY;
+	} else if (m->opens > 0) {
+		err = ERR_TXTBUSY;
+	} else {
+		err = sizeMemDisk(m, (st.st_size / BLOCKSIZE) * BLOCKSIZE);
+	}
+	for (int done = 0; err == 0 && done < m->size; ) {
+		ssize_t r = read(fd, m->data + done, m->size - done);
+		if (r <= 0) {
+			err = (r == -1) ? tfs_error(errno) : ERR_IO;
+			break;
+		}
+		done += r;
+	}
+	close(fd);
+	return err;
+}
+
+int bufferWrites(int disk) {
+	if (heldDisk >= 0) {
+		return (heldDisk == disk) ? 0 : ERR_TXTBUSY;
+	}
+	heldDisk = disk;
+	return 0;
+}
+
+int flushWrites(int disk) {
+	if (disk != heldDisk) {
+		return 0;
+	}
+	struct iovec iov[FLUSH_RUN];
+	int i = 0, first, n;
+	// Write each run of consecutive held blocks with one call
+	while (i < nHeld) {
+		if (held[i] == NULL) {
+			i++;
+			continue;
+		}
+		for (first = i, n = 0; i < nHeld && held[i] && n < FLUSH_RUN; i++, n++) {
+			iov[n].iov_base = held[i];
+			iov[n].iov_len = BLOCKSIZE;
+		}
+		int err = writeAt(disk, iov, n, (off_t) first * BLOCKSIZE);
+		if (err < 0) {
+			return err;
+		}
+		stats_add(blockWrites, n);
+		for (int j = first; j < i; j++) {
+			free(held[j]);
+			held[j] = NULL;
+		}
+	}
+	free(held);
+	held = NULL;
+	nHeld = 0;
+	heldDisk = -1;
+	return 0;
+}
+
+int pinBlock(int disk, int bNum, void** block) {
+	uint8_t* data = cache_get(disk, bNum);
+	if (data) {
+		stats_add(cacheHits, 1);
+		trace(TFS_TRACE_READ_BLOCK, trace_now(), bNum, disk, BLOCKSIZE, 0);
+	} else {
+		uint8_t tmp[BLOCKSIZE];
+		int err = readBlock(disk, bNum, tmp);
+		if (err < 0) {
+			return err;
+		}
+		if ((data = cache_get(disk, bNum)) == NULL) {
+			// Every cache slot is pinned
+			return ERR_NOMEMORY;
+		}
+	}
+	cache_pin(data);
+	*block = data;
+	return 0;
+}
+
+int unpinBlock(const void* block) {
+	if (cache_unpin(block) < 0) {
+		return ERR_INVALID;
+	}
+	return 0;
+}
+
 int tfs_error(int errnum) {
 #ifdef DEBUG_FLAG
 	printf("%s\n", strerror(errnum));
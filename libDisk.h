@@ -13,9 +13,29 @@ to maintain integrity of any file content beyond nBytes. The return value
 is negative on failure or a disk number on success. */
 int openDisk(char* filename, int nBytes);
 
+/* A ‘filename’ starting with "mem:" names a RAM disk instead, kept in
+memory by this process. Opening it with a non-zero nBytes creates it (or
+resizes it), and it keeps its contents across closeDisk() until the
+process exits. Its blocks are read and written without system calls. */
+
+/* Flags for openDiskFlags() */
+#define DISK_DIRECT 1
+
+/* openDiskFlags() opens a disk like openDisk(), with ‘flags’. DISK_DIRECT
+opens the file with O_DIRECT so blocks bypass the host's page cache, for
+callers that cache blocks themselves. Every transfer is then made in
+aligned 4096 byte units through a small pool of aligned buffers, and the
+disk size must be a multiple of 4096 bytes. */
+int openDiskFlags(char* filename, int nBytes, int flags);
+
 /* This function closes a disk. */
 int closeDisk(int disk);
 
+/* resizeDisk() grows or shrinks the open disk to nBytes, rounded down
+to a multiple of BLOCKSIZE like openDisk(). Blocks past the old end read
+as zeros, blocks past the new end are lost. */
+int resizeDisk(int disk, int nBytes);
+
 /* readBlock() reads an entire block of BLOCKSIZE bytes from the open
 disk (identified by ‘disk’) and copies the result into a local buffer
 (must be at least of BLOCKSIZE bytes). The bNum is a logical block
@@ -37,5 +57,40 @@ is not available (i.e. hasn’t been opened) or any other failures. You
 must define your own error code system. */
 int writeBlock(int disk, int bNum, void* block);
 
+/* writeBlocks() writes ‘n’ consecutive blocks starting at bNum from
+‘blocks’ (n * BLOCKSIZE bytes) with as few system calls as possible. */
+int writeBlocks(int disk, int bNum, int n, void* blocks);
+
+/* discardBlocks() tells the host the ‘n’ blocks starting at bNum are no
+longer needed by punching a hole over them in the disk file, freeing the
+host storage behind them. They read as zeros afterwards, and a pending
+held write to any of them is dropped. */
+int discardBlocks(int disk, int bNum, int n);
+
+/* saveDisk() writes the whole of the RAM disk ‘disk’ to the host file
+‘filename’ with one sequential write, and loadDisk() reads the host
+file ‘filename’ back in the same way as the RAM disk ‘diskname’, which
+must not be open. A disk holding writes cannot be saved. */
+int saveDisk(int disk, char* filename);
+int loadDisk(char* filename, char* diskname);
+
+/* After bufferWrites(), blocks written to ‘disk’ are held in memory
+(reads see them) until flushWrites() writes them out in ascending block
+order, each run of consecutive blocks with a single system call, and
+stops holding writes. closeDisk() flushes too. Only one disk may hold
+writes at a time. */
+int bufferWrites(int disk);
+int flushWrites(int disk);
+
+/* Blocks read and written are kept in a small write-through cache.
+pinBlock() points ‘block’ at the cached copy of block bNum, reading it
+first if needed, and holds it in the cache until unpinBlock() is called
+with any pointer into it. A pinned block never changes: writing the
+block leaves the pinned copy as it was and caches the new contents
+separately. Pins may be nested and outlive closeDisk(). pinBlock()
+fails if every cached block is pinned. */
+int pinBlock(int disk, int bNum, void** block);
+int unpinBlock(const void* block);
+
 // LIBDISK_H
 #endif
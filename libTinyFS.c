@@ -1,16 +1,25 @@
 #include <errno.h>
+#include <pthread.h>
 #include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #ifdef DEBUG_FLAG
 	#include <stdio.h>
 #endif
 
 #include "tinyFS.h"
+#include "tinyFS_dir.h"
+#include "tinyFS_layout.h"
 #include "libDisk.h"
-#include "slice.h"
+#include "pool.h"
 #include "bitset.h"
+#include "dedup.h"
+#include "stats.h"
+#include "trace.h"
+#include "async.h"
+#include "bloom.h"
 
 #ifdef DEBUG_FLAG
 	#define dbg(...) fprintf(stderr, __VA_ARGS__)
@@ -18,43 +27,23 @@
 	#define dbg(...)
 #endif
 
-#define BLOCK_SUPER 1
-#define BLOCK_INODE 2
-#define BLOCK_EXTENT 3
-#define BLOCK_FREE 4
-
-#define FLAG_ISDIR 1
-#define FLAG_WRITE 2
-#define FLAG_READ 4
+#define FLAG_ISDIR TFS_FLAG_ISDIR
+#define FLAG_WRITE TFS_FLAG_WRITE
+#define FLAG_READ TFS_FLAG_READ
 #define FLAGS_RDWR (FLAG_READ | FLAG_WRITE)
 #define FLAGS_DIR (FLAG_ISDIR | FLAGS_RDWR)
 
-#define SUPER_ADDRESS 0
-#define ROOT_ADDRESS 1
-#define START_ADDRESS (ROOT_ADDRESS + 1)
-
-#define DEFAULT_TABLE_SIZE 32
-#define BLOCK_HEADER_SIZE 4
-#define MAX_FILENAME_SIZE 8
-#define INODE_HEADER_SIZE (BLOCK_HEADER_SIZE + 1 + MAX_FILENAME_SIZE + sizeof(int) + 1)
-#define BLOCK_DATA_SIZE (BLOCKSIZE - BLOCK_HEADER_SIZE)
-#define INODE_DATA_SIZE (BLOCKSIZE - INODE_HEADER_SIZE)
-#define MAX_DISK_SIZE (BLOCKSIZE * (UCHAR_MAX+1))
-
-#define IS_BAD_BLOCK(blk) ((blk)[0] > BLOCK_FREE || (blk)[1] != 0x44 || (blk)[3] != 0)
+#define FLAGS_SNAPSHOT (FLAG_ISDIR | FLAG_READ)
 
 /* Mounted disk number */
 int mnt = -1;
 
-/* Open file table */
-slice_t fileTable;
-fileDescriptor nextFD = -1;
-
 typedef struct {
 	int bNum;
 	uint8_t data[BLOCKSIZE];
 } Block;
 
+/* A directory being walked, or a file being looked up */
 typedef struct {
 	int inode, dir;
 	char name[MAX_FILENAME_SIZE];
@@ -63,13 +52,109 @@ typedef struct {
 	Block buf;
 } File;
 
+/* In-memory state of an open file, shared by every descriptor open on
+the same inode of the same directory. inode is -1 once the file has been
+deleted or its snapshot dropped, leaving its descriptors only closable. */
+typedef struct Inode {
+	int inode, dir;
+	uint8_t flags;
+	int size;
+	/* Descriptors open on the inode */
+	int refs;
+	/* Block number within the file of buf */
+	int blk;
+	Block buf;
+	/* Disk block of each block of the file walked so far, 0 for holes.
+	Blocks [0, mapEnd) are mapped, the walk resumes at block mapEnd which
+	is stored in mapNext (0 past the end of the chain). */
+	uint8_t map[MAX_FILE_BLOCKS];
+	int mapEnd, mapNext;
+	/* Free blocks held back for writes to the file, see tfs_reserve */
+	int reserved;
+	struct Inode* next;
+} Inode;
+
+typedef struct {
+	Inode* ip;
+	int ptr;
+} FD;
+
+/* Open file table */
+pool_t fdTable;
+/* Open inodes, chained by inode block */
+Inode* inodeTable[MAX_BLOCKS];
+
+/* A block of a file's chain. blk is its block number within the file,
+old the block it was read from and next the block old pointed at (both
+0 for a new block), and bNum the block it is written to. */
+typedef struct {
+	int blk;
+	int old, next;
+	int bNum;
+} Link;
+
 Block superBlock = {0};
 int nextBlock = -1;
 
 File rootDir = {0};
 int nextRoot = -1;
 
-int _tfs_seek(File* fp, int offset);
+/* Set between tfs_beginBatch and tfs_commitBatch, while block writes are
+held in memory */
+int batching = 0;
+
+/* Blocks freed in discard mode during a batch. They are only punched out
+once the batch is committed, as until then the disk may still hold the
+chains that use them. */
+uint8_t batchDiscards[MAX_BLOCKS >> 3];
+
+/* Blocks of the inode table, in order, none if the disk has no table */
+uint8_t itable[MAX_ITABLE_BLOCKS];
+int nItable = 0;
+
+/* Number of references (directory entries and chain links) to each
+block, rebuilt on mount. Blocks with more than one reference are shared
+and must be copied before they are written. */
+uint8_t refCount[MAX_BLOCKS];
+
+/* Names in each directory, indexed by the directory's inode, so that a
+lookup of a name that is not there can skip the scan. Built while the
+references are counted at mount and never written to disk. */
+bloom_t* nameFilters[MAX_BLOCKS];
+
+/* Free blocks reserved by all open files, only their writes may
+allocate them */
+int reservedBlocks = 0;
+
+int seekDir(File* dir, int offset);
+int nextFile(File* dir, char** name);
+int nextFreeBlock();
+int initCounters(void);
+int mapBlock(Inode* ip, int blk);
+int _tfs_commitBatch(void);
+int countRefs(void);
+void putInode(Inode* ip);
+static int chainBlocks(Inode* ip, uint8_t* chain, int n);
+static uint64_t beginCall(void);
+static bloom_t* nameFilter(int dir, int create);
+static void dropFilters(void);
+static int endCall(int op, uint64_t start, int fd, int size, int ret);
+
+/* Mark bNum used in the bitmap, keeping the free count in step */
+static void useBlock(int bNum) {
+	if (bitset_is_set(superBlock.data+5, bNum)) {
+		bitset_clear(superBlock.data+5, bNum);
+		superBlock.data[SUPER_FREE]--;
+	}
+}
+
+/* Mark bNum free in the bitmap, keeping the free count in step */
+static void releaseBlock(int bNum) {
+	if (bitset_is_clear(superBlock.data+5, bNum)) {
+		bitset_set(superBlock.data+5, bNum);
+		superBlock.data[SUPER_FREE]++;
+	}
+}
 
 int _readBlock(int bNum, Block* block) {
 	if (mnt < 0) {
@@ -83,6 +168,52 @@ int _readBlock(int bNum, Block* block) {
 	return 0;
 }
 
+/* Copy the size, flags and parent in the header of the inode at bNum
+to its inode table record */
+int putInodeRecord(int bNum, uint8_t* inode) {
+	int t = bNum / ITABLE_RECORDS;
+	if (t >= nItable) {
+		return 0;
+	}
+	uint8_t block[BLOCKSIZE], rec[ITABLE_RECORD_SIZE];
+	memcpy(rec, inode + BLOCK_HEADER_SIZE + 1 + MAX_FILENAME_SIZE, 4);
+	rec[4] = inode[INODE_HEADER_SIZE-1];
+	rec[5] = inode[BLOCK_HEADER_SIZE];
+	int err = readBlock(mnt, itable[t], block);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	uint8_t* p = block + BLOCK_HEADER_SIZE + (bNum % ITABLE_RECORDS) * ITABLE_RECORD_SIZE;
+	if (memcmp(p, rec, ITABLE_RECORD_SIZE) == 0) {
+		return 0;
+	}
+	memcpy(p, rec, ITABLE_RECORD_SIZE);
+	return writeBlock(mnt, itable[t], block);
+}
+
+/* Fill in the size, flags and parent of file from the inode table record
+of the inode at bNum. Returns 1 if found, 0 if there is no table. */
+int getInodeRecord(int bNum, File* file) {
+	int t = bNum / ITABLE_RECORDS;
+	if (t >= nItable) {
+		return 0;
+	}
+	uint8_t block[BLOCKSIZE];
+	int err = readBlock(mnt, itable[t], block);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	uint8_t* p = block + BLOCK_HEADER_SIZE + (bNum % ITABLE_RECORDS) * ITABLE_RECORD_SIZE;
+	file->size = ((uint32_t) p[0])       |
+				 ((uint32_t) p[1])<<8  |
+				 ((uint32_t) p[2])<<16 |
+				 ((uint32_t) p[3])<<24;
+	file->flags = p[4];
+	file->dir = p[5];
+	return 1;
+}
+
+/* Write block to bNum, keeping the inode table record of an inode in step */
 int _writeBlock(int bNum, Block* block) {
 	if (mnt < 0) {
 		return ERR_BADF;
@@ -91,24 +222,96 @@ int _writeBlock(int bNum, Block* block) {
 	if (IS_TFS_ERROR(err)) {
 		return err;
 	}
+	if (block->data[0] == BLOCK_INODE) {
+		return putInodeRecord(bNum, block->data);
+	}
 	return 0;
 }
 
+/* Find the blocks of the inode table. A chain block that is not
+BLOCK_ITABLE fails the mount rather than serving stale records; the
+inodes still hold everything the table does, so tfsck can drop it. */
+int loadInodeTable(void) {
+	uint8_t block[BLOCKSIZE];
+	nItable = 0;
+	if ((superBlock.data[SUPER_FEATURES] & FEATURE_ITABLE) == 0) {
+		return 0;
+	}
+	for (int bNum = superBlock.data[SUPER_ITABLE]; bNum > 0; bNum = block[2]) {
+		int err = readBlock(mnt, bNum, block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		if (block[0] != BLOCK_ITABLE || nItable == MAX_ITABLE_BLOCKS) {
+			return ERR_INVALID;
+		}
+		itable[nItable++] = bNum;
+	}
+	return 0;
+}
 
-int tfs_mkfs(char* filename, int nBytes) {
+/* Add blocks to the inode table until it has a record for every block */
+int growInodeTable(void) {
+	if ((superBlock.data[SUPER_FEATURES] & FEATURE_ITABLE) == 0) {
+		return 0;
+	}
+	uint8_t block[BLOCKSIZE];
+	int err;
+	while (nItable * ITABLE_RECORDS < superBlock.data[4]) {
+		int bNum = nextFreeBlock();
+		if (bNum <= 0) {
+			return ERR_NOMEMORY;
+		}
+		memset(block, 0, BLOCKSIZE);
+		block[0] = BLOCK_ITABLE;
+		block[1] = 0x44;
+		err = writeBlock(mnt, bNum, block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		useBlock(bNum);
+		err = readBlock(mnt, itable[nItable-1], block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		block[2] = bNum;
+		err = writeBlock(mnt, itable[nItable-1], block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		itable[nItable++] = bNum;
+	}
+	return 0;
+}
+
+
+int _tfs_mkfs(char* filename, int nBytes, int flags) {
 	int nBlocks = nBytes / BLOCKSIZE;
+	int nTable = (flags & TFS_MKFS_ITABLE) ? (nBlocks + ITABLE_RECORDS - 1) / ITABLE_RECORDS : 0;
+	if (nBlocks < START_ADDRESS + nTable) {
+		return ERR_INVALID;
+	}
 	int disk = openDisk(filename, nBytes);
 	if (IS_TFS_ERROR(disk)) {
 		return disk;
 	}
-	/* Initialize free blocks */
-	uint8_t block[BLOCKSIZE] = {BLOCK_FREE, 0x44};
+	/* Free blocks are only known by the bitmap and are left as they are
+	until first allocated */
+	uint8_t block[BLOCKSIZE] = {0, 0x44};
 	int i, err;
-	for (i = START_ADDRESS; i < nBlocks; i++) {
-		err = writeBlock(disk, i, block);
+	/* Initialize the inode table, just past the root directory */
+	block[0] = BLOCK_ITABLE;
+	for (i = 0; i < nTable; i++) {
+		block[2] = (i+1 < nTable) ? START_ADDRESS+i+1 : 0;
+		if (i == 0) {
+			// Record of the root directory
+			block[BLOCK_HEADER_SIZE + ROOT_ADDRESS * ITABLE_RECORD_SIZE + 4] = FLAGS_DIR;
+		}
+		err = writeBlock(disk, START_ADDRESS+i, block);
 		if (IS_TFS_ERROR(err)) {
 			return err;
 		}
+		memset(block+2, 0, BLOCKSIZE-2);
 	}
 	/* Initialize root directory */
 	block[0] = BLOCK_INODE;
@@ -131,6 +334,16 @@ int tfs_mkfs(char* filename, int nBytes) {
 	}
 	block[n-1] >>= (8 - (nBlocks & 7)) & 7;
 	block[5] &= 0xff << START_ADDRESS;
+	for (i = 0; i < nTable; i++) {
+		bitset_clear(block+5, START_ADDRESS+i);
+	}
+	if (nTable > 0) {
+		block[SUPER_FEATURES] |= FEATURE_ITABLE;
+		block[SUPER_ITABLE] = START_ADDRESS;
+	}
+	block[SUPER_FEATURES] |= FEATURE_COUNTERS;
+	block[SUPER_FREE] = nBlocks - START_ADDRESS - nTable;
+	block[SUPER_FILES] = 0;
 	err = writeBlock(disk, SUPER_ADDRESS, block);
 	if (IS_TFS_ERROR(err)) {
 		return err;
@@ -143,10 +356,15 @@ int tfs_mkfs(char* filename, int nBytes) {
 	return 0;
 }
 
+/* Check the header of every block in use. Free blocks may never have
+been written and hold anything. */
 int tfs_verify(void) {
 	uint8_t block[BLOCKSIZE];
-	int err, n = superBlock.data[4];
+	int err = 0, n = superBlock.data[4];
 	for (int i = START_ADDRESS; i < n; i++) {
+		if (bitset_is_set(superBlock.data+5, i)) {
+			continue;
+		}
 		err = readBlock(mnt, i, block);
 		if (IS_TFS_ERROR(err)) {
 			return err;
@@ -159,12 +377,12 @@ int tfs_verify(void) {
 	return err;
 }
 
-int tfs_mount(char* diskname) {
+static int mountDisk(char* diskname, int flags) {
 	if (mnt >= 0) {
 		// Another disk is already mounted
 		return ERR_TXTBUSY;
 	}
-	int retValue = openDisk(diskname, 0);
+	int retValue = openDiskFlags(diskname, 0, (flags & TFS_MOUNT_DIRECT) ? DISK_DIRECT : 0);
 	if (IS_TFS_ERROR(retValue)) {
 		dbg("could not open disk\n");
 		return retValue;
@@ -185,6 +403,11 @@ int tfs_mount(char* diskname) {
 		dbg("invalid FS\n");
 		return retValue;
 	}
+	retValue = loadInodeTable();
+	if (IS_TFS_ERROR(retValue)) {
+		dbg("bad inode table\n");
+		return retValue;
+	}
 	retValue = readBlock(mnt, ROOT_ADDRESS, rootDir.buf.data);
 	if (IS_TFS_ERROR(retValue)) {
 		dbg("error reading root\n");
@@ -203,20 +426,46 @@ int tfs_mount(char* diskname) {
 			       ((uint32_t) rootDir.buf.data[off+3])<<24;
 	rootDir.flags = rootDir.buf.data[off+4];
 	rootDir.ptr = 0;
-	fileTable = slice_new(DEFAULT_TABLE_SIZE, sizeof(File));
+	retValue = countRefs();
+	if (IS_TFS_ERROR(retValue)) {
+		dbg("error counting references\n");
+		return retValue;
+	}
+	if ((superBlock.data[SUPER_FEATURES] & FEATURE_COUNTERS) == 0) {
+		retValue = initCounters();
+		if (IS_TFS_ERROR(retValue)) {
+			return retValue;
+		}
+	}
+	fdTable = pool_new(sizeof(FD));
 	dbg("%d free blocks\n", bitset_popcnt(superBlock.data+5, superBlock.data[4]));
 	return 0;
 }
 
-int tfs_unmount(void) {
+/* A disk that fails to mount is closed again, so it can be made over */
+int _tfs_mount(char* diskname, int flags) {
+	int busy = (mnt >= 0);
+	int err = mountDisk(diskname, flags);
+	if (IS_TFS_ERROR(err) && !busy && mnt >= 0) {
+		closeDisk(mnt);
+		mnt = -1;
+	}
+	return err;
+}
+
+int _tfs_unmount(void) {
 	if (mnt < 0) {
 		return ERR_BADF;
 	}
-	int err = writeBlock(mnt, SUPER_ADDRESS, superBlock.data);
+	int err = batching ? _tfs_commitBatch() : 0;
 	if (IS_TFS_ERROR(err)) {
 		return err;
 	}
-	err = writeBlock(mnt, ROOT_ADDRESS, rootDir.buf.data);
+	err = writeBlock(mnt, SUPER_ADDRESS, superBlock.data);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	err = writeBlock(mnt, rootDir.buf.bNum, rootDir.buf.data);
 	if (IS_TFS_ERROR(err)) {
 		return err;
 	}
@@ -225,17 +474,218 @@ int tfs_unmount(void) {
 		return err;
 	}
 	mnt = -1;
-	nextFD = -1;
 	nextBlock = -1;
-	slice_free(fileTable);
+	nItable = 0;
+	batching = 0;
+	dedup_reset();
+	dropFilters();
+	// Every open inode is held by a descriptor, including those already
+	// taken out of the inode table by a delete or a dropped snapshot
+	FD* fp;
+	for (int fd = 0; fd < fdTable.nChunks * POOL_CHUNK; fd++) {
+		if ((fp = pool_get(&fdTable, fd)) != NULL) {
+			putInode(fp->ip);
+		}
+	}
+	pool_free(&fdTable);
+	reservedBlocks = 0;
 	return 0;
 }
 
+/* Grow the mounted disk to nBytes. The bitmap has room for the largest
+disk, and free blocks need not be written, so only the block count
+changes. */
+int _tfs_resize(int nBytes) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	}
+	int n = superBlock.data[4], nBlocks = nBytes / BLOCKSIZE;
+	if (nBlocks > UCHAR_MAX) {
+		return ERR_INVALID;
+	} else if (nBlocks < n) {
+		// Shrinking moves blocks out from under open files
+		return ERR_TXTBUSY;
+	} else if (nBlocks == n) {
+		return 0;
+	}
+	int err = resizeDisk(mnt, nBytes);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	for (int i = n; i < nBlocks; i++) {
+		releaseBlock(i);
+	}
+	superBlock.data[4] = nBlocks;
+	dbg("grew fs from %d to %d blocks\n", n, nBlocks);
+	err = growInodeTable();
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	return writeBlock(mnt, SUPER_ADDRESS, superBlock.data);
+}
+
+/* Point every entry of the directory at dNum according to remap */
+static int remapDir(int dNum, uint8_t* remap) {
+	File dir = {0};
+	dir.inode = dNum;
+	dir.buf.bNum = -1;
+	int err = seekDir(&dir, 0);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	char* entry;
+	int addr;
+	while ((addr = nextFile(&dir, &entry)) >= 0) {
+		if (remap[addr] != addr) {
+			entry[MAX_FILENAME_SIZE] = remap[addr];
+			err = writeBlock(mnt, dir.buf.bNum, dir.buf.data);
+			if (IS_TFS_ERROR(err)) {
+				return err;
+			}
+		}
+	}
+	return (addr == ERR_EOF) ? 0 : addr;
+}
+
+/* Move every block in use at or past nBlocks to a free block below it,
+patch the chain links, directory entries and snapshot entries pointing
+at the moved blocks, and drop the tail from the disk */
+static int evictTail(int nBlocks) {
+	uint8_t remap[MAX_BLOCKS];
+	uint8_t block[BLOCKSIZE];
+	uint8_t* bitmap = superBlock.data+5;
+	int i, err, n = superBlock.data[4];
+	int tailUsed = (n - nBlocks) - (bitset_popcnt(bitmap, n) - bitset_popcnt(bitmap, nBlocks));
+	if (tailUsed > bitset_popcnt(bitmap, nBlocks)) {
+		return ERR_NOMEMORY;
+	}
+	for (i = 0; i < MAX_BLOCKS; i++) {
+		remap[i] = i;
+	}
+	for (i = nBlocks; i < n; i++) {
+		if (bitset_is_set(bitmap, i)) {
+			continue;
+		}
+		int to = bitset_ctz(bitmap, nBlocks);
+		err = readBlock(mnt, i, block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		err = writeBlock(mnt, to, block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		useBlock(to);
+		remap[i] = to;
+		dbg("moved block %d to %d\n", i, to);
+	}
+	for (i = ROOT_ADDRESS; i < nBlocks; i++) {
+		if (bitset_is_set(bitmap, i)) {
+			continue;
+		}
+		err = readBlock(mnt, i, block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		if (remap[block[2]] == block[2] && (block[0] != BLOCK_INODE || remap[block[4]] == block[4])) {
+			continue;
+		}
+		block[2] = remap[block[2]];
+		if (block[0] == BLOCK_INODE) {
+			block[4] = remap[block[4]];
+		}
+		err = writeBlock(mnt, i, block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+	}
+	err = remapDir(rootDir.inode, remap);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	uint8_t* entry = superBlock.data + SUPER_SNAPSHOTS;
+	for (i = 0; i < MAX_SNAPSHOTS; i++, entry += ENTRY_SIZE) {
+		if (entry[MAX_FILENAME_SIZE] == 0) {
+			continue;
+		}
+		entry[MAX_FILENAME_SIZE] = remap[entry[MAX_FILENAME_SIZE]];
+		err = remapDir(entry[MAX_FILENAME_SIZE], remap);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+	}
+	if (superBlock.data[SUPER_ITABLE] > 0) {
+		superBlock.data[SUPER_ITABLE] = remap[superBlock.data[SUPER_ITABLE]];
+	}
+	// Snapshot directories may have moved, lookups scan until remount
+	dropFilters();
+	for (i = nBlocks; i < n; i++) {
+		useBlock(i);
+	}
+	superBlock.data[4] = nBlocks;
+	nextBlock = -1;
+	// The records of moved inodes, and of inodes whose parent moved, are
+	// out of date, so rewrite every record
+	err = loadInodeTable();
+	for (i = ROOT_ADDRESS; i < nBlocks && nItable > 0 && !IS_TFS_ERROR(err); i++) {
+		if (bitset_is_clear(bitmap, i) && !IS_TFS_ERROR(err = readBlock(mnt, i, block))
+				&& block[0] == BLOCK_INODE) {
+			err = putInodeRecord(i, block);
+		}
+	}
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	// Unmounting writes the buffered root directory back
+	return _readBlock(rootDir.inode, &rootDir.buf);
+}
+
+int _tfs_resizeImage(char* filename, int nBytes) {
+	if (mnt >= 0) {
+		return ERR_TXTBUSY;
+	}
+	int nBlocks = nBytes / BLOCKSIZE;
+	if (nBlocks < START_ADDRESS || nBlocks > UCHAR_MAX) {
+		return ERR_INVALID;
+	}
+	int err = _tfs_mount(filename, 0);
+	if (IS_TFS_ERROR(err)) {
+		if (mnt >= 0) {
+			closeDisk(mnt);
+			mnt = -1;
+		}
+		return err;
+	}
+	int shrink = nBlocks < superBlock.data[4];
+	err = shrink ? evictTail(nBlocks) : _tfs_resize(nBytes);
+	int unmountErr = _tfs_unmount();
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	} else if (IS_TFS_ERROR(unmountErr)) {
+		return unmountErr;
+	} else if (!shrink) {
+		return 0;
+	}
+	int disk = openDisk(filename, 0);
+	if (IS_TFS_ERROR(disk)) {
+		return disk;
+	}
+	err = resizeDisk(disk, nBlocks * BLOCKSIZE);
+	closeDisk(disk);
+	dbg("shrank fs to %d blocks\n", nBlocks);
+	return err;
+}
+
 /* Number of blocks into a file where ptr resides. (i.e. ptr < 240 = 0, ptr < 492 = 1, etc.) */
 static inline int blockNum(int ptr) {
 	return ((ptr - INODE_DATA_SIZE) / BLOCK_DATA_SIZE) + (ptr >= INODE_DATA_SIZE);
 }
 
+/* Offset into a file of the first byte of block blk */
+static inline int blockStart(int blk) {
+	return (blk == 0) ? 0 : INODE_DATA_SIZE + (blk-1) * BLOCK_DATA_SIZE;
+}
+
 int ptrIndex(int ptr, int* off) {
 	if (ptr < INODE_DATA_SIZE) {
 		if (off) *off = INODE_HEADER_SIZE;
@@ -246,36 +696,67 @@ int ptrIndex(int ptr, int* off) {
 	return ptr + BLOCK_HEADER_SIZE;
 }
 
-fileDescriptor nextFreeFD() {
-	int next = nextFD;
-	if (next >= 0) {
-		nextFD = -1;
-		return next;
-	}
-	File* fp;
-	for (int i = 0; i < fileTable.len; i++) {
-		fp = ((File*) fileTable.ptr) + i;
-		if (fp->inode < 0) {
-			return i;
-		}
-	}
-	return -1;
+/* Free blocks that are not reserved */
+int freeCount(void) {
+	return superBlock.data[SUPER_FREE] - reservedBlocks;
 }
 
 int nextFreeBlock() {
+	if (freeCount() <= 0) {
+		return -1;
+	}
+	// The block freed last is only a hint, it may have been taken since
+	// by an allocation that placed its blocks itself
 	int next = nextBlock;
-	if (next > 0) {
-		nextBlock = -1;
+	nextBlock = -1;
+	if (next > 0 && bitset_is_set(superBlock.data+5, next)) {
 		return next;
 	}
+	stats_add(allocScans, 1);
 	next = bitset_ctz(superBlock.data+5, superBlock.data[4]);
 	dbg("next free block: %d\n", next);
-	if (next < superBlock.data[4]<<3) {
+	if (next < superBlock.data[4]) {
 		return next;
 	}
 	return -1;
 }
 
+/* Count the free blocks and the files of a disk made before the counts
+were kept in the superblock */
+int initCounters(void) {
+	File dir = rootDir;
+	char* name;
+	int bNum, files = 0;
+	dir.ptr = 0;
+	while ((bNum = nextFile(&dir, &name)) >= 0) {
+		files += (bNum > 0);
+	}
+	if (bNum != ERR_EOF) {
+		return bNum;
+	}
+	stats_add(allocScans, 1);
+	superBlock.data[SUPER_FREE] = bitset_popcnt(superBlock.data+5, superBlock.data[4]);
+	superBlock.data[SUPER_FILES] = files;
+	superBlock.data[SUPER_FEATURES] |= FEATURE_COUNTERS;
+	dbg("counted %d free blocks and %d files\n", superBlock.data[SUPER_FREE], files);
+	return 0;
+}
+
+/* Let up to n blocks of the reservation of ip be allocated by its next
+write, returns the number let go. The caller puts back what it does not
+end up needing with keepReserve. */
+static int drawReserve(Inode* ip, int n) {
+	int drawn = (ip->reserved < n) ? ip->reserved : n;
+	ip->reserved -= drawn;
+	reservedBlocks -= drawn;
+	return drawn;
+}
+
+static void keepReserve(Inode* ip, int n) {
+	ip->reserved += n;
+	reservedBlocks += n;
+}
+
 int nextFile(File* dir, char** name) {
 	dbg("next file in /\n");
 	int off;
@@ -301,55 +782,213 @@ int nextFile(File* dir, char** name) {
 	return addr;
 }
 
-int getFile(fileDescriptor fd, File** fp) {
-	if (mnt < 0) {
-		return ERR_IO;
-	} else if (fd >= fileTable.len) {
-		return ERR_BADF;
+/* The name filter of dir, allocated empty if it has none and create is
+set. NULL means lookups in dir have to scan it. */
+static bloom_t* nameFilter(int dir, int create) {
+	if (nameFilters[dir] == NULL && create) {
+		nameFilters[dir] = malloc(sizeof(bloom_t));
+		if (nameFilters[dir]) {
+			bloom_reset(nameFilters[dir]);
+		}
 	}
-	*fp = ((File*) fileTable.ptr) + fd;
-	if ((*fp)->inode <= 0) {
-		return ERR_BADF;
+	return nameFilters[dir];
+}
+
+static void dropFilters(void) {
+	for (int i = 0; i < MAX_BLOCKS; i++) {
+		free(nameFilters[i]);
+		nameFilters[i] = NULL;
 	}
-	return 0;
 }
 
-int findFile(File* file) {
-	dbg("finding file\n");
+/* Count the links of the chain starting at bNum. A block that was already
+counted has had its successors counted with it, so the walk stops there. */
+int countChain(int bNum, int index) {
+	uint8_t block[BLOCKSIZE];
 	int err;
-	if (rootDir.buf.bNum != rootDir.inode) {
-		dbg("reading root dir\n");
-		err = readBlock(mnt, rootDir.inode, rootDir.buf.data);
+	while (bNum > 0) {
+		err = readBlock(mnt, bNum, block);
 		if (IS_TFS_ERROR(err)) {
 			return err;
 		}
-		rootDir.buf.bNum = rootDir.inode;
-	}
-	rootDir.ptr = 0;
-	char* name;
-	int bNum, firstFree = -1;
-	while ((bNum = nextFile(&rootDir, &name)) >= 0) {
-		if (bNum == 0 && firstFree != -1) {
-			firstFree = rootDir.ptr - (MAX_FILENAME_SIZE + 1);
-		} else if (strncmp(file->name, name, MAX_FILENAME_SIZE) == 0) {
+		if (index && block[0] == BLOCK_EXTENT) {
+			dedup_insert(bNum, dedup_hash(block, BLOCKSIZE));
+		}
+		bNum = block[2];
+		if (bNum > 0 && refCount[bNum]++ > 0) {
 			break;
 		}
-//		rootDir.ptr += MAX_FILENAME_SIZE + 1;
-	}
-	if (IS_TFS_ERROR(bNum)) {
-		dbg("file not found!\n");
-		return bNum;
 	}
-	dbg("file found!\n");
-	err = readBlock(mnt, bNum, file->buf.data);
+	return 0;
+}
+
+/* Count the directory's own chain and every file it points at. The
+directory itself must already have been counted by its referrer. */
+int countDir(File* dir, int index) {
+	int err = countChain(dir->inode, 0);
 	if (IS_TFS_ERROR(err)) {
 		return err;
 	}
-	file->buf.bNum = bNum;
+	if (dir->buf.bNum != dir->inode) {
+		err = readBlock(mnt, dir->inode, dir->buf.data);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		dir->buf.bNum = dir->inode;
+	}
+	bloom_t* names = nameFilter(dir->inode, 1);
+	if (names == NULL) {
+		return ERR_NOMEMORY;
+	}
+	dir->ptr = 0;
+	char* name;
+	int bNum;
+	while ((bNum = nextFile(dir, &name)) >= 0) {
+		if (bNum > 0) {
+			bloom_add(names, name, strnlen(name, MAX_FILENAME_SIZE));
+		}
+		if (bNum > 0 && refCount[bNum]++ == 0) {
+			err = countChain(bNum, index);
+			if (IS_TFS_ERROR(err)) {
+				return err;
+			}
+		}
+	}
+	return (bNum == ERR_EOF) ? 0 : bNum;
+}
+
+/* Rebuild the reference count of every block reachable from the root
+directory or a snapshot, indexing file extents when dedup is enabled. */
+int countRefs(void) {
+	memset(refCount, 0, sizeof(refCount));
+	dedup_reset();
+	dropFilters();
+	int index = superBlock.data[SUPER_FEATURES] & FEATURE_DEDUP;
+	refCount[ROOT_ADDRESS] = 1;
+	int err = countDir(&rootDir, index);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	File snap = {0};
+	uint8_t* entry = superBlock.data + SUPER_SNAPSHOTS;
+	for (int i = 0; i < MAX_SNAPSHOTS; i++, entry += ENTRY_SIZE) {
+		snap.inode = entry[MAX_FILENAME_SIZE];
+		if (snap.inode <= 0 || refCount[snap.inode]++ > 0) {
+			continue;
+		}
+		snap.buf.bNum = -1;
+		err = countDir(&snap, index);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+	}
+	dbg("counted refs\n");
+	return 0;
+}
+
+int getFile(fileDescriptor fd, FD** fp) {
+	if (mnt < 0) {
+		return ERR_IO;
+	}
+	*fp = pool_get(&fdTable, fd);
+	if (*fp == NULL || (*fp)->ip->inode <= 0) {
+		return ERR_BADF;
+	}
+	return 0;
+}
+
+/* Forget the buffered block and block map of ip, after its chain changed */
+static inline void resetMap(Inode* ip) {
+	ip->buf.bNum = -1;
+	ip->mapEnd = 0;
+	ip->mapNext = ip->inode;
+}
+
+static void unlinkInode(Inode* ip) {
+	if (ip->inode <= 0) {
+		return;
+	}
+	Inode** pp = &inodeTable[ip->inode];
+	while (*pp && *pp != ip) {
+		pp = &(*pp)->next;
+	}
+	if (*pp) {
+		*pp = ip->next;
+	}
+	ip->next = NULL;
+}
+
+static void linkInode(Inode* ip) {
+	ip->next = inodeTable[ip->inode];
+	inodeTable[ip->inode] = ip;
+}
+
+/* Take a reference to the open inode of file, opening it if needed */
+Inode* getInode(File* file) {
+	Inode* ip;
+	for (ip = inodeTable[file->inode]; ip; ip = ip->next) {
+		if (ip->dir == file->dir) {
+			ip->refs++;
+			return ip;
+		}
+	}
+	if ((ip = malloc(sizeof(Inode))) == NULL) {
+		return NULL;
+	}
+	ip->inode = file->inode;
+	ip->dir = file->dir;
+	ip->flags = file->flags;
+	ip->size = file->size;
+	ip->refs = 1;
+	ip->reserved = 0;
+	resetMap(ip);
+	linkInode(ip);
+	return ip;
+}
+
+void putInode(Inode* ip) {
+	if (--ip->refs > 0) {
+		return;
+	}
+	drawReserve(ip, ip->reserved);
+	unlinkInode(ip);
+	free(ip);
+}
+
+/* Open a descriptor on file */
+fileDescriptor openFD(File* file) {
+	fileDescriptor fd;
+	FD* fp = pool_alloc(&fdTable, &fd);
+	if (fp == NULL) {
+		return ERR_NOMEMORY;
+	}
+	if ((fp->ip = getInode(file)) == NULL) {
+		pool_release(&fdTable, fd);
+		return ERR_NOMEMORY;
+	}
+	fp->ptr = 0;
+	return fd;
+}
+
+/* Fill in the parent, size and flags of file from the inode at bNum,
+reading only its inode table record when the disk has a table */
+int readInode(int bNum, File* file) {
 	file->inode = bNum;
 	file->ptr = 0;
+	int err = getInodeRecord(bNum, file);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	} else if (err) {
+		file->buf.bNum = -1;
+		return bNum;
+	}
+	err = readBlock(mnt, bNum, file->buf.data);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	file->buf.bNum = bNum;
 	int idx = BLOCK_HEADER_SIZE + MAX_FILENAME_SIZE;
-	file->dir = file->buf.data[idx];
+	file->dir = file->buf.data[BLOCK_HEADER_SIZE];
 	file->size = ((uint32_t) file->buf.data[idx+1])       |
 				 ((uint32_t) file->buf.data[idx+2])<<8  |
 				 ((uint32_t) file->buf.data[idx+3])<<16 |
@@ -358,8 +997,51 @@ int findFile(File* file) {
 	return bNum;
 }
 
+int findFile(File* file) {
+	dbg("finding file\n");
+	bloom_t* names = nameFilter(rootDir.inode, 0);
+	if (names && !bloom_maybe(names, file->name, strnlen(file->name, MAX_FILENAME_SIZE))) {
+		dbg("file not found!\n");
+		return 0;
+	}
+	int err;
+	if (rootDir.buf.bNum != rootDir.inode) {
+		dbg("reading root dir\n");
+		err = readBlock(mnt, rootDir.inode, rootDir.buf.data);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		rootDir.buf.bNum = rootDir.inode;
+	}
+	rootDir.ptr = 0;
+	char* name;
+	int bNum, firstFree = -1;
+	while ((bNum = nextFile(&rootDir, &name)) >= 0) {
+		if (bNum == 0 && firstFree != -1) {
+			firstFree = rootDir.ptr - (MAX_FILENAME_SIZE + 1);
+		} else if (bNum > 0 && strncmp(file->name, name, MAX_FILENAME_SIZE) == 0) {
+			break;
+		}
+//		rootDir.ptr += MAX_FILENAME_SIZE + 1;
+	}
+	if (bNum == ERR_EOF) {
+		dbg("file not found!\n");
+		return 0;
+	} else if (IS_TFS_ERROR(bNum)) {
+		dbg("file not found!\n");
+		return bNum;
+	}
+	dbg("file found!\n");
+	return readInode(bNum, file);
+}
+
 int findFileInDir(char* name, File* file, File* dir) {
 	dbg("finding file\n");
+	bloom_t* names = nameFilter(dir->inode, 0);
+	if (names && !bloom_maybe(names, name, strnlen(name, MAX_FILENAME_SIZE))) {
+		dbg("file not found!\n");
+		return 0;
+	}
 	int err;
 	if (dir->buf.bNum != dir->inode) {
 		dbg("reading root dir\n");
@@ -373,36 +1055,21 @@ int findFileInDir(char* name, File* file, File* dir) {
 	char* namep;
 	int bNum, firstFree = -1;
 	while ((bNum = nextFile(dir, &namep)) >= 0) {
-		if (bNum == 0 && firstFree != -1) {
-			firstFree = dir->ptr;
-		} else if (strncmp(name, namep, MAX_FILENAME_SIZE) == 0) {
+		if (bNum == 0 && firstFree == -1) {
+			firstFree = dir->ptr - (MAX_FILENAME_SIZE + 1);
+		} else if (bNum > 0 && strncmp(name, namep, MAX_FILENAME_SIZE) == 0) {
 			break;
 		}
 //		dir->ptr += MAX_FILENAME_SIZE + 1;
 	}
-	if (bNum == ERR_EOF && firstFree != -1) {
+	if (bNum == ERR_EOF) {
 		dbg("file not found!\n");
-		return _tfs_seek(dir, firstFree);
+		return 0;
 	} else if (IS_TFS_ERROR(bNum)) {
 		return bNum;
-	} else {
-		dbg("file found!\n");
-		err = readBlock(mnt, bNum, file->buf.data);
-		if (IS_TFS_ERROR(err)) {
-			return err;
-		}
 	}
-	file->buf.bNum = bNum;
-	file->inode = bNum;
-	file->ptr = 0;
-	int idx = BLOCK_HEADER_SIZE + MAX_FILENAME_SIZE;
-	file->dir = file->buf.data[idx];
-	file->size = ((uint32_t) file->buf.data[idx+1])       |
-				 ((uint32_t) file->buf.data[idx+2])<<8  |
-				 ((uint32_t) file->buf.data[idx+3])<<16 |
-				 ((uint32_t) file->buf.data[idx+4])<<24;
-	file->flags = file->buf.data[idx+5];
-	return bNum;
+	dbg("file found!\n");
+	return readInode(bNum, file);
 }
 
 int _findFile(File* file) {
@@ -436,13 +1103,20 @@ int findOrMakeFile(char* name, File* dir) {
 		}
 		dir->buf.bNum = dir->inode;
 	}
+	int nameLen = strnlen(name, MAX_FILENAME_SIZE);
+	bloom_t* names = nameFilter(dir->inode, 0);
+	// A name the filter has never seen only needs a free entry
+	int absent = names && !bloom_maybe(names, name, nameLen);
 	dir->ptr = 0;
 	int bNum, firstFree = -1;
 	char* entry;
 	while ((bNum = nextFile(dir, &entry)) >= 0) {
 		if (bNum == 0 && firstFree == -1) {
 			firstFree = dir->ptr - (MAX_FILENAME_SIZE + 1);
-		} else if (strncmp(name, entry, MAX_FILENAME_SIZE) == 0) {
+			if (absent) {
+				break;
+			}
+		} else if (bNum > 0 && strncmp(name, entry, MAX_FILENAME_SIZE) == 0) {
 			return bNum;
 		}
 	}
@@ -451,7 +1125,7 @@ int findOrMakeFile(char* name, File* dir) {
 	} else if (firstFree == -1) {
 		return ERR_NOMEMORY;
 	}
-	err = _tfs_seek(dir, firstFree);
+	err = seekDir(dir, firstFree);
 	if (IS_TFS_ERROR(err)) {
 		return err;
 	}
@@ -461,16 +1135,48 @@ int findOrMakeFile(char* name, File* dir) {
 	}
 	int off, idx;
 	idx = ptrIndex(firstFree, &off);
-	int nameLen = strlen(name);
 	memcpy(dir->buf.data+idx, name, nameLen);
 	dir->buf.data[idx+MAX_FILENAME_SIZE] = bNum;
 	err = writeBlock(mnt, dir->buf.bNum, dir->buf.data);
 	if (IS_TFS_ERROR(err)) {
 		return err;
 	}
+	if (names) {
+		bloom_add(names, name, nameLen);
+	}
 	return bNum;
 }
 
+/* Point the entry of dir that points at bNum to newBNum instead, clearing
+the entry when newBNum is 0 */
+int replaceEntry(File* dir, int bNum, int newBNum) {
+	int err;
+	if (dir->buf.bNum != dir->inode) {
+		err = readBlock(mnt, dir->inode, dir->buf.data);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		dir->buf.bNum = dir->inode;
+	}
+	dir->ptr = 0;
+	int addr;
+	char* entry;
+	while ((addr = nextFile(dir, &entry)) >= 0) {
+		if (addr == bNum) {
+			if (newBNum == 0) {
+				bloom_t* names = nameFilter(dir->inode, 0);
+				if (names) {
+					bloom_remove(names, entry, strnlen(entry, MAX_FILENAME_SIZE));
+				}
+				memset(entry, 0, MAX_FILENAME_SIZE);
+			}
+			entry[MAX_FILENAME_SIZE] = newBNum;
+			return writeBlock(mnt, dir->buf.bNum, dir->buf.data);
+		}
+	}
+	return (addr == ERR_EOF) ? 0 : addr;
+}
+
 int openDir(char* path, File* dir) {
 	int nameSize;
 	char* name = strtok(path, "/");
@@ -489,7 +1195,7 @@ int openDir(char* path, File* dir) {
 	return 0;
 }
 
-fileDescriptor tfs_openFile(char* name) {
+fileDescriptor _tfs_openFile(char* name) {
 	dbg("opening %s\n", name);
 	int pathLen = strlen(name);
 	if (pathLen == 0) {
@@ -532,19 +1238,19 @@ fileDescriptor tfs_openFile(char* name) {
 		return bNum;
 	} else if (bNum == 0) {
 		dbg("file not found!\n");
+		file.buf.data[0] = BLOCK_INODE;
 		file.buf.data[1] = 0x44;
 		idx = BLOCK_HEADER_SIZE;
 		file.buf.data[idx] = rootDir.inode;
 		idx += 1;
 		memcpy(file.buf.data+idx, file.name, MAX_FILENAME_SIZE);
 		idx += MAX_FILENAME_SIZE;
-		file.buf.data[idx] = FLAGS_RDWR;
-		idx += 1;
 		memset(file.buf.data+idx, 0, BLOCKSIZE-idx);
-		if ((bNum = nextFreeBlock()) <= 0) {
-			return ERR_NOMEMORY;
+		file.buf.data[INODE_HEADER_SIZE-1] = FLAGS_RDWR;
+		if ((bNum = findOrMakeFile(name, &rootDir)) <= 0) {
+			return IS_TFS_ERROR(bNum) ? bNum : ERR_NOMEMORY;
 		}
-		err = writeBlock(mnt, bNum, file.buf.data);
+		err = _writeBlock(bNum, &file.buf);
 		if (IS_TFS_ERROR(err)) {
 			return err;
 		}
@@ -552,230 +1258,2049 @@ fileDescriptor tfs_openFile(char* name) {
 		file.inode = bNum;
 		file.dir = rootDir.inode;
 		file.flags = FLAGS_RDWR;
-		bitset_clear(superBlock.data+5, bNum);
-	}
-	fileDescriptor fd = nextFreeFD();
-	if (fd < 0) {
-		dbg("appending\n");
-		fd = fileTable.len;
-		fileTable = slice_append(fileTable, &file);
-	} else {
-		memcpy(((File*) fileTable.ptr) + fd, &file, sizeof(File));
+		useBlock(bNum);
+		refCount[bNum] = 1;
+		superBlock.data[SUPER_FILES]++;
 	}
+	fileDescriptor fd = openFD(&file);
 	dbg("%s opened with fd %d (size %d)\n", name, fd, file.size);
 	return fd;
 }
 
-int tfs_closeFile(fileDescriptor fd) {
-	File* fp;
-	int err = getFile(fd, &fp);
-	if (IS_TFS_ERROR(err)) {
-		return err;
+int _tfs_closeFile(fileDescriptor fd) {
+	if (mnt < 0) {
+		return ERR_IO;
 	}
-	fp->inode = -1;
-	fp->flags = 0;
-	fp->buf.bNum = -1;
-	memset(fp->buf.data, 0, BLOCKSIZE);
-	if (nextFD < 0) {
-		nextFD = fd;
+	// Descriptors of deleted files can still be closed
+	FD* fp = pool_get(&fdTable, fd);
+	if (fp == NULL) {
+		return ERR_BADF;
 	}
+	putInode(fp->ip);
+	pool_release(&fdTable, fd);
 	return 0;
 }
 
-/* Free all blocks of fp from bNum to the EOF */
-int freeBlocks(File* fp, int bNum) {
+/* Punch out each run of the blocks set in set. Discarding is only advice
+to the host, so a host file that cannot have holes is not an error. */
+static void discardRuns(uint8_t* set) {
+	int i = 0, first;
+	if (batching) {
+		for (i = 0; i < (MAX_BLOCKS >> 3); i++) {
+			batchDiscards[i] |= set[i];
+		}
+		return;
+	}
+	while (i < MAX_BLOCKS) {
+		if (bitset_is_clear(set, i)) {
+			i++;
+			continue;
+		}
+		for (first = i; i < MAX_BLOCKS && bitset_is_set(set, i); i++);
+		if (IS_TFS_ERROR(discardBlocks(mnt, first, i - first))) {
+			dbg("could not discard blocks %d-%d\n", first, i-1);
+		}
+	}
+}
+
+/* Free all blocks of a chain from bNum to the EOF. Drops one reference to
+bNum, a shared block and everything after it is left to its other owners.
+In discard mode the freed blocks are punched out of the disk file instead
+of being marked free, the bitmap alone says they are free. */
+int freeBlocks(int bNum) {
+	Block block;
+	uint8_t freed[MAX_BLOCKS >> 3] = {0};
+	int discard = superBlock.data[SUPER_FEATURES] & FEATURE_DISCARD;
 	int err, next;
 	while (bNum > 0) {
-		err = readBlock(mnt, bNum, fp->buf.data);
-		if (IS_TFS_ERROR(err)) {
-			return err;
+		if (refCount[bNum] > 1) {
+			dbg("block %d is shared, dropping reference\n", bNum);
+			refCount[bNum]--;
+			break;
 		}
-		next = fp->buf.data[2];
-		fp->buf.data[0] = BLOCK_FREE;
-		fp->buf.data[2] = 0;
-		err = writeBlock(mnt, bNum, fp->buf.data);
+		refCount[bNum] = 0;
+		dedup_remove(bNum);
+		err = _readBlock(bNum, &block);
 		if (IS_TFS_ERROR(err)) {
 			return err;
 		}
+		next = block.data[2];
+		if (discard) {
+			bitset_set(freed, bNum);
+		} else {
+			block.data[0] = BLOCK_FREE;
+			block.data[2] = 0;
+			block.data[3] = 0;
+			err = _writeBlock(bNum, &block);
+			if (IS_TFS_ERROR(err)) {
+				return err;
+			}
+		}
 		if (nextBlock <= 0) {
 			nextBlock = bNum;
 		}
-		bitset_set(superBlock.data+5, bNum);
+		releaseBlock(bNum);
 		bNum = next;
 	}
+	if (discard) {
+		discardRuns(freed);
+	}
 	return 0;
 }
 
 
-int tfs_writeFile(fileDescriptor fd, char* buffer, int size) {
-	File* fp;
-	int err = getFile(fd, &fp);
+/* Give ip a private copy of its inode when the inode is shared with a
+snapshot, repointing the live directory entry, and so every descriptor
+open on the inode, at the copy. The rest of the chain stays shared until
+the write path copies it. */
+int unshareInode(Inode* ip) {
+	int old = ip->inode;
+	if (refCount[old] <= 1) {
+		return 0;
+	}
+	int err = _readBlock(old, &ip->buf);
 	if (IS_TFS_ERROR(err)) {
-		dbg("error getting file\n");
 		return err;
-	} else if ((fp->flags & FLAG_ISDIR)) {
-		dbg("file is dir\n");
-		return ERR_ISDIR;
-	} else if ((fp->flags & FLAG_WRITE) == 0) {
-		dbg("no write access\n");
-		return ERR_ACCESS;
-	} else if (size > fp->size) {
-		int need = blockNum(size-1) - blockNum(fp->size-1);
-		int have = bitset_popcnt(superBlock.data+5, superBlock.data[4]);
-		if (need > have) {
-			return ERR_NOMEMORY;
-		}
 	}
-	fp->size = size;
-	int off = BLOCK_HEADER_SIZE;
-	int n, nBytes = BLOCK_DATA_SIZE;
-	int next, bNum = fp->inode;
-	while (size > 0 && bNum > 0) {
-		err = readBlock(mnt, bNum, fp->buf.data);
-		if (IS_TFS_ERROR(err)) {
-			return err;
-		}
-		dbg("read block %d\n", bNum);
-		if (bNum == fp->inode) {
-			dbg("writing inode (size %d)\n", size);
-			off = BLOCK_HEADER_SIZE + MAX_FILENAME_SIZE;
-			fp->buf.data[0] = BLOCK_INODE;
-			dbg("size offset: %d\n", off);
-			fp->buf.data[off++] = size;
-			fp->buf.data[off++] = size>>8;
-			fp->buf.data[off++] = size>>16;
-			fp->buf.data[off++] = size>>24;
-			n = (size < (BLOCKSIZE-INODE_HEADER_SIZE)) ? size : (BLOCKSIZE-INODE_HEADER_SIZE);
-			memcpy(fp->buf.data+off, buffer, n * sizeof(char));
-			off = BLOCK_HEADER_SIZE;
-		} else {
-			fp->buf.data[0] = BLOCK_EXTENT;
-			n = size < nBytes ? size : nBytes;
-			memcpy(fp->buf.data+off, buffer, n * sizeof(char));
-		}
-		next = fp->buf.data[2];
-		if (size <= n) {
-			dbg("final block of file\n");
-			fp->buf.data[2] = 0;
-		} else if (next <= 0) {
-			dbg("need free block\n");
-			if ((next = nextFreeBlock()) <= 0) {
-				dbg("error getting next free block\n");
-				return ERR_NOMEMORY;
-			}
-			fp->buf.data[2] = next;
-		}
-		dbg("next block: %d\n", next);
-		err = writeBlock(mnt, bNum, fp->buf.data);
-		if (IS_TFS_ERROR(err)) {
-			return err;
-		}
-		dbg("wrote block %d\n", bNum);
-		bitset_clear(superBlock.data+5, bNum);
-		if (next > 0) {
-			bitset_clear(superBlock.data+5, next);
-		}
-		bNum = next;
-		size -= n;
-		buffer += n;
+	int next = ip->buf.data[2];
+	if (next > 0 && refCount[next] == UCHAR_MAX) {
+		return ERR_OVERFLOW;
 	}
-	if (size > 0) {
-		return ERR_IO;
+	// The copy is part of the write, it may use the file's reservation
+	int drawn = drawReserve(ip, 1);
+	int bNum = nextFreeBlock();
+	if (bNum <= 0) {
+		keepReserve(ip, drawn);
+		return ERR_NOMEMORY;
 	}
-	err = freeBlocks(fp, bNum);
+	err = _writeBlock(bNum, &ip->buf);
 	if (IS_TFS_ERROR(err)) {
+		keepReserve(ip, drawn);
 		return err;
 	}
-	fp->ptr = 0;
-	return 0;
-}
-
-int tfs_deleteFile(fileDescriptor fd) {
-	File* fp;
-	int err = getFile(fd, &fp);
-	if (IS_TFS_ERROR(err)) {
-		return err;
-	} else if ((fp->flags & FLAG_ISDIR)) {
-		return ERR_ISDIR;
-	} else if ((fp->flags & FLAG_WRITE) == 0) {
-		return ERR_ACCESS;
+	useBlock(bNum);
+	refCount[bNum] = 1;
+	if (next > 0) {
+		refCount[next]++;
 	}
-	err = freeBlocks(fp, fp->inode);
+	err = replaceEntry(&rootDir, old, bNum);
 	if (IS_TFS_ERROR(err)) {
 		return err;
 	}
-	return tfs_closeFile(fd);
+	refCount[old]--;
+	dbg("copied shared inode %d to %d\n", old, bNum);
+	unlinkInode(ip);
+	ip->inode = bNum;
+	linkInode(ip);
+	resetMap(ip);
+	return 0;
 }
 
-int tfs_readByte(fileDescriptor fd, char* buffer) {
-	dbg("reading byte\n");
-	File* fp;
-	int err = getFile(fd, &fp);
+/* Return a block holding exactly the image in block, sharing an identical
+block when one is indexed and writing a new one otherwise. Either way the
+returned block gains a reference. */
+int dedupBlock(uint8_t* block) {
+	uint8_t cmp[BLOCKSIZE];
+	uint32_t hash = dedup_hash(block, BLOCKSIZE);
+	int err, bNum;
+	for (bNum = dedup_first(hash); bNum > 0; bNum = dedup_next(bNum)) {
+		err = readBlock(mnt, bNum, cmp);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		if (memcmp(block, cmp, BLOCKSIZE) == 0 && refCount[bNum] < UCHAR_MAX) {
+			dbg("sharing block %d\n", bNum);
+			refCount[bNum]++;
+			return bNum;
+		}
+	}
+	if ((bNum = nextFreeBlock()) <= 0) {
+		return ERR_NOMEMORY;
+	}
+	err = writeBlock(mnt, bNum, block);
 	if (IS_TFS_ERROR(err)) {
 		return err;
-	} else if (fp->flags & FLAG_ISDIR) {
-		return ERR_ISDIR;
-	} else if (fp->ptr >= fp->size) {
-		return ERR_FAULT;
 	}
-	int off;
-	int idx = ptrIndex(fp->ptr, &off);
-	dbg("off: %d, idx: %d\n", off, idx);
-	if (idx == off) {
-		// Read next block of file
-		int bNum = (fp->ptr == 0) ? fp->inode : fp->buf.data[2];
-		if (bNum <= 0) {
-			return ERR_FAULT;
+	useBlock(bNum);
+	refCount[bNum] = 1;
+	dedup_insert(bNum, hash);
+	return bNum;
+}
+
+/* Write the file back to front so each extent's next pointer is known
+before it is fingerprinted, letting identical tails of different files
+share their blocks. The old chain is released last so it can be shared
+with the new one. */
+int dedupWriteFile(Inode* ip, char* buffer, int size) {
+	int nExtents = blockNum(size-1);
+	int old = -1;
+	// Blocks shared with other files use up the reservation all the same
+	int drawn = drawReserve(ip, nExtents);
+	int err, have = freeCount();
+	int i, off, start, n, next = 0;
+	if (nExtents > have) {
+		// Not enough room to keep both chains. Giving up the old one first
+		// only frees its blocks up to the first one shared, so fail before
+		// touching it unless those make room.
+		uint8_t chain[MAX_FILE_BLOCKS + 1];
+		n = chainBlocks(ip, chain, MAX_FILE_BLOCKS + 1);
+		if (IS_TFS_ERROR(n)) {
+			keepReserve(ip, drawn);
+			return n;
+		}
+		for (i = 1; i < n && refCount[chain[i]] <= 1; i++);
+		// Walking the chain mapped it, and it is about to change
+		resetMap(ip);
+		if (nExtents > have + i - 1) {
+			keepReserve(ip, drawn);
+			return ERR_NOMEMORY;
+		}
+		err = _readBlock(ip->inode, &ip->buf);
+		if (IS_TFS_ERROR(err)) {
+			keepReserve(ip, drawn);
+			return err;
+		}
+		// Empty until the new chain is in place
+		old = ip->buf.data[2];
+		off = BLOCK_HEADER_SIZE + 1 + MAX_FILENAME_SIZE;
+		ip->buf.data[2] = 0;
+		memset(ip->buf.data+off, 0, 4);
+		err = _writeBlock(ip->inode, &ip->buf);
+		if (IS_TFS_ERROR(err)) {
+			keepReserve(ip, drawn);
+			return err;
 		}
-		dbg("Reading next block %d\n", bNum);
-		err = readBlock(mnt, bNum, fp->buf.data);
+		ip->size = 0;
+		err = freeBlocks(old);
 		if (IS_TFS_ERROR(err)) {
+			keepReserve(ip, drawn);
 			return err;
 		}
-		fp->buf.bNum = bNum;
+		old = 0;
+	}
+	uint8_t block[BLOCKSIZE];
+	for (i = nExtents; i > 0; i--) {
+		start = INODE_DATA_SIZE + (i-1) * BLOCK_DATA_SIZE;
+		n = (size - start < BLOCK_DATA_SIZE) ? size - start : BLOCK_DATA_SIZE;
+		memset(block, 0, BLOCKSIZE);
+		block[0] = BLOCK_EXTENT;
+		block[1] = 0x44;
+		block[2] = next;
+		memcpy(block+BLOCK_HEADER_SIZE, buffer+start, n);
+		int bNum = dedupBlock(block);
+		if (IS_TFS_ERROR(bNum)) {
+			freeBlocks(next);
+			keepReserve(ip, drawn);
+			return bNum;
+		}
+		if (next > 0 && refCount[bNum] > 1) {
+			// A block already on disk already links to next, the new
+			// chain only adds the one link to bNum
+			refCount[next]--;
+		}
+		next = bNum;
+	}
+	err = _readBlock(ip->inode, &ip->buf);
+	if (IS_TFS_ERROR(err)) {
+		freeBlocks(next);
+		keepReserve(ip, drawn);
+		return err;
+	}
+	if (old < 0) {
+		old = ip->buf.data[2];
+	}
+	off = BLOCK_HEADER_SIZE + 1 + MAX_FILENAME_SIZE;
+	ip->buf.data[0] = BLOCK_INODE;
+	ip->buf.data[2] = next;
+	ip->buf.data[3] = 0;
+	ip->buf.data[off++] = size;
+	ip->buf.data[off++] = size>>8;
+	ip->buf.data[off++] = size>>16;
+	ip->buf.data[off++] = size>>24;
+	n = (size < INODE_DATA_SIZE) ? size : INODE_DATA_SIZE;
+	memcpy(ip->buf.data+INODE_HEADER_SIZE, buffer, n);
+	memset(ip->buf.data+INODE_HEADER_SIZE+n, 0, INODE_DATA_SIZE-n);
+	err = _writeBlock(ip->inode, &ip->buf);
+	if (IS_TFS_ERROR(err)) {
+		freeBlocks(next);
+		keepReserve(ip, drawn);
+		return err;
+	}
+	ip->size = size;
+	// The write is done, an old block left behind is only lost space
+	if (IS_TFS_ERROR(freeBlocks(old))) {
+		dbg("could not free the old chain\n");
 	}
-
-	dbg("block[%d] = '%c'\n", idx, fp->buf.data[idx]);
-	*buffer = fp->buf.data[idx];
-	++fp->ptr;
 	return 0;
 }
 
-int _tfs_seek(File* fp, int offset) {
-	if (offset >= fp->size) {
-		fp->ptr = offset;
-		return 0;
+/* Give back the blocks chain[from, to) taken for a write that failed */
+static void releaseChain(uint8_t* chain, int from, int to) {
+	for (int i = from; i < to; i++) {
+		releaseBlock(chain[i]);
+		refCount[chain[i]] = 0;
 	}
-	int ptrBlock = blockNum(fp->ptr);
-	int offBlock = blockNum(offset);
-	int bNum, nBlocks;
-	if (offBlock < ptrBlock) {
-		bNum = fp->inode;
-		nBlocks = offBlock + 1;
+}
+
+/* Store the disk blocks of the first n links of ip's chain in chain,
+taken from the block map as far as it has been walked and read from the
+chain past that. Returns the number stored, fewer than n when the chain
+is shorter. */
+static int chainBlocks(Inode* ip, uint8_t* chain, int n) {
+	int bNum, i = 0;
+	for (int blk = 0; i < n && blk < MAX_FILE_BLOCKS; blk++) {
+		if ((bNum = mapBlock(ip, blk)) < 0) {
+			return bNum;
+		} else if (bNum > 0) {
+			chain[i++] = bNum;
+		} else if (blk >= ip->mapEnd) {
+			break;
+		}
+	}
+	return i;
+}
+
+int _tfs_writeFile(fileDescriptor fd, char* buffer, int size) {
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (IS_TFS_ERROR(err)) {
+		dbg("error getting file\n");
+		return err;
+	}
+	Inode* ip = fp->ip;
+	if ((ip->flags & FLAG_ISDIR)) {
+		dbg("file is dir\n");
+		return ERR_ISDIR;
+	} else if ((ip->flags & FLAG_WRITE) == 0) {
+		dbg("no write access\n");
+		return ERR_ACCESS;
+	} else if (size < 0) {
+		return ERR_INVALID;
+	} else if (size > MAX_FILE_SIZE) {
+		return ERR_OVERFLOW;
+	}
+	int dedup = superBlock.data[SUPER_FEATURES] & FEATURE_DEDUP;
+	// The old chain is kept up to its first shared block, the rest of the
+	// file goes to newly allocated blocks. A shared inode is copied first,
+	// which shares the whole chain.
+	uint8_t chain[MAX_FILE_BLOCKS + 1];
+	int nBlocks = blockNum(size-1) + 1;
+	int shared = refCount[ip->inode] > 1;
+	int nOld = 0, keep = 1;
+	if (!dedup) {
+		nOld = chainBlocks(ip, chain, nBlocks + 1);
+		if (IS_TFS_ERROR(nOld)) {
+			return nOld;
+		}
+		while (!shared && keep < nOld && keep < nBlocks && refCount[chain[keep]] <= 1) {
+			keep++;
+		}
+	}
+	// dedupWriteFile makes sure of room for its own blocks
+	int need = shared + (dedup ? 0 : nBlocks - keep);
+	if (need > freeCount() + ip->reserved) {
+		return ERR_NOMEMORY;
+	}
+	err = unshareInode(ip);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	fp->ptr = 0;
+	if (dedup) {
+		resetMap(ip);
+		return dedupWriteFile(ip, buffer, size);
+	}
+	chain[0] = ip->inode;
+	int drop = (keep < nOld) ? chain[keep] : 0;
+	int i, bNum, drawn = drawReserve(ip, nBlocks - keep);
+	for (i = keep; i < nBlocks; i++) {
+		if ((bNum = nextFreeBlock()) <= 0) {
+			releaseChain(chain, keep, i);
+			keepReserve(ip, drawn);
+			return ERR_NOMEMORY;
+		}
+		chain[i] = bNum;
+		useBlock(bNum);
+		refCount[bNum] = 1;
+	}
+	err = _readBlock(ip->inode, &ip->buf);
+	// Build every block whole, nothing old needs to be read back
+	uint8_t* images = IS_TFS_ERROR(err) ? NULL : malloc(nBlocks * BLOCKSIZE);
+	if (images == NULL) {
+		releaseChain(chain, keep, nBlocks);
+		keepReserve(ip, drawn);
+		return IS_TFS_ERROR(err) ? err : ERR_NOMEMORY;
+	}
+	memset(images, 0, nBlocks * BLOCKSIZE);
+	memcpy(images, ip->buf.data, INODE_HEADER_SIZE);
+	int off = BLOCK_HEADER_SIZE + 1 + MAX_FILENAME_SIZE;
+	images[off++] = size;
+	images[off++] = size>>8;
+	images[off++] = size>>16;
+	images[off++] = size>>24;
+	int n, left = size;
+	for (i = 0; i < nBlocks; i++) {
+		uint8_t* block = images + i * BLOCKSIZE;
+		block[0] = (i == 0) ? BLOCK_INODE : BLOCK_EXTENT;
+		block[1] = 0x44;
+		block[2] = (i+1 < nBlocks) ? chain[i+1] : 0;
+		block[3] = 0;
+		off = (i == 0) ? INODE_HEADER_SIZE : BLOCK_HEADER_SIZE;
+		n = (left < BLOCKSIZE - off) ? left : BLOCKSIZE - off;
+		memcpy(block + off, buffer, n);
+		buffer += n;
+		left -= n;
+		dedup_remove(chain[i]);
+	}
+	// The inode table record goes first and is put back if the blocks
+	// cannot be written. Then one write for each run of consecutive blocks,
+	// the last run first so the file keeps its old chain until the run
+	// holding the inode is written.
+	err = putInodeRecord(ip->inode, images);
+	int runs[MAX_FILE_BLOCKS + 1], nRuns = 0;
+	for (i = 0; i < nBlocks; i += n) {
+		for (n = 1; i+n < nBlocks && chain[i+n] == chain[i] + n; n++);
+		runs[nRuns++] = i;
+	}
+	runs[nRuns] = nBlocks;
+	while (--nRuns >= 0 && !IS_TFS_ERROR(err)) {
+		i = runs[nRuns];
+		n = runs[nRuns+1] - i;
+		err = writeBlocks(mnt, chain[i], n, images + i * BLOCKSIZE);
+		dbg("wrote blocks %d-%d\n", chain[i], chain[i] + n - 1);
+	}
+	free(images);
+	resetMap(ip);
+	if (IS_TFS_ERROR(err)) {
+		putInodeRecord(ip->inode, ip->buf.data);
+		releaseChain(chain, keep, nBlocks);
+		keepReserve(ip, drawn);
+		ip->buf.bNum = -1;
+		return err;
+	}
+	ip->buf.bNum = -1;
+	ip->size = size;
+	// The new chain is known, the next write need not walk it
+	memcpy(ip->map, chain, nBlocks);
+	ip->mapEnd = nBlocks;
+	ip->mapNext = 0;
+	// The write is done, an old block left behind is only lost space
+	if (IS_TFS_ERROR(freeBlocks(drop))) {
+		dbg("could not free the old chain\n");
+	}
+	return 0;
+}
+
+/* Read the links of ip's chain up to and including the first block past
+block last of the file, returns the number of links read. */
+int loadChain(Inode* ip, Link* links, int last) {
+	uint8_t block[BLOCKSIZE];
+	int err, n = 0, blk = 0, bNum = ip->inode;
+	while (bNum > 0) {
+		links[n].blk = blk;
+		links[n].old = links[n].bNum = bNum;
+		links[n].next = 0;
+		if (blk > last) {
+			return n + 1;
+		}
+		err = readBlock(mnt, bNum, block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		links[n++].next = block[2];
+		blk += 1 + block[3];
+		bNum = block[2];
+	}
+	return n;
+}
+
+/* Add new links for the holes among blocks first to last, returns the
+new number of links. */
+int fillChain(Link* links, int n, int first, int last) {
+	Link tmp[MAX_FILE_BLOCKS];
+	int i = 0, j = 0;
+	for (int blk = first; blk <= last; blk++) {
+		while (i < n && links[i].blk < blk) {
+			tmp[j++] = links[i++];
+		}
+		if (i < n && links[i].blk == blk) {
+			tmp[j++] = links[i++];
+		} else {
+			tmp[j++] = (Link) {blk, 0, 0, 0};
+		}
+	}
+	while (i < n) {
+		tmp[j++] = links[i++];
+	}
+	memcpy(links, tmp, j * sizeof(Link));
+	return j;
+}
+
+/* Copy n bytes starting skip bytes into the buffers of iov to dst */
+static void gatherIov(uint8_t* dst, const struct iovec* iov, int iovcnt, size_t skip, size_t n) {
+	for (int i = 0; i < iovcnt && n > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		size_t len = iov[i].iov_len - skip;
+		if (len > n) {
+			len = n;
+		}
+		memcpy(dst, (char*) iov[i].iov_base + skip, len);
+		dst += len;
+		n -= len;
+		skip = 0;
+	}
+}
+
+/* Copy n bytes from src to the buffers of iov, starting skip bytes in */
+static void scatterIov(const uint8_t* src, const struct iovec* iov, int iovcnt, size_t skip, size_t n) {
+	for (int i = 0; i < iovcnt && n > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		size_t len = iov[i].iov_len - skip;
+		if (len > n) {
+			len = n;
+		}
+		memcpy((char*) iov[i].iov_base + skip, src, len);
+		src += len;
+		n -= len;
+		skip = 0;
+	}
+}
+
+/* Give back the blocks writeChain allocated for links[1, to), putting
+the links back on their old blocks */
+static void releaseLinks(Link* links, int to, int shared) {
+	for (int i = 1; i < to; i++) {
+		if (links[i].old <= 0 || i >= shared) {
+			releaseBlock(links[i].bNum);
+			refCount[links[i].bNum] = 0;
+			links[i].bNum = links[i].old;
+		}
+	}
+}
+
+/* Write links[0..hi] of ip's chain, ending the chain at links[hi] when
+it is the last link. Within the file, bytes [zero, from) are zeroed and
+[from, to) gathered from iov (zeroed if iov is NULL). New links, and
+every link from the first shared block up to hi, get newly allocated
+blocks so nothing shared is written, unless the caller already placed
+them (bNum differs from old). A link is only rewritten when its data or
+next pointer changes. */
+int writeChain(Inode* ip, Link* links, int n, int hi, int zero, const struct iovec* iov, int iovcnt, int from, int to) {
+	int i, err = 0, shared = hi + 1, need = 0;
+	resetMap(ip);
+	for (i = 1; i <= hi; i++) {
+		if (shared > hi && links[i].old > 0 && refCount[links[i].old] > 1) {
+			shared = i;
+		}
+		if (links[i].old <= 0 || i >= shared) {
+			need++;
+		}
+	}
+	int drawn = drawReserve(ip, need);
+	if (need > freeCount()) {
+		keepReserve(ip, drawn);
+		return ERR_NOMEMORY;
+	} else if (shared <= hi && hi+1 < n && refCount[links[hi+1].bNum] == UCHAR_MAX) {
+		keepReserve(ip, drawn);
+		return ERR_OVERFLOW;
+	}
+	for (i = 1; i <= hi; i++) {
+		if (links[i].old <= 0 || i >= shared) {
+			if (links[i].bNum == links[i].old && (links[i].bNum = nextFreeBlock()) <= 0) {
+				links[i].bNum = links[i].old;
+				releaseLinks(links, i, shared);
+				keepReserve(ip, drawn);
+				return ERR_NOMEMORY;
+			}
+			useBlock(links[i].bNum);
+			refCount[links[i].bNum] = 0;
+		}
+	}
+	Block block;
+	int drop[MAX_FILE_BLOCKS];
+	int nDrop = 0, written = 0;
+	int lo = (zero < from) ? zero : from;
+	for (i = 0; i <= hi; i++) {
+		Link* l = links + i;
+		int next = (i+1 < n) ? links[i+1].bNum : 0;
+		int gap = (i+1 < n) ? links[i+1].blk - l->blk - 1 : 0;
+		int start = blockStart(l->blk);
+		int off = (l->blk == 0) ? INODE_HEADER_SIZE : BLOCK_HEADER_SIZE;
+		int end = start + BLOCKSIZE - off;
+		int inPlace = (l->bNum == l->old);
+		if (i > 0 && inPlace && l->next == next && (end <= lo || start >= to)) {
+			continue;
+		}
+		if (l->old > 0) {
+			err = _readBlock(l->old, &block);
+			if (IS_TFS_ERROR(err)) {
+				break;
+			}
+		} else {
+			memset(block.data, 0, BLOCKSIZE);
+			block.data[1] = 0x44;
+		}
+		block.data[0] = (i == 0) ? BLOCK_INODE : BLOCK_EXTENT;
+		block.data[2] = next;
+		block.data[3] = gap;
+		if (i == 0) {
+			int idx = BLOCK_HEADER_SIZE + 1 + MAX_FILENAME_SIZE;
+			block.data[idx++] = ip->size;
+			block.data[idx++] = ip->size>>8;
+			block.data[idx++] = ip->size>>16;
+			block.data[idx++] = ip->size>>24;
+		}
+		int a = (lo > start) ? lo : start;
+		int b = (from < end) ? from : end;
+		if (a < b) {
+			memset(block.data + off + a - start, 0, b - a);
+		}
+		a = (from > start) ? from : start;
+		b = (to < end) ? to : end;
+		if (a < b) {
+			if (iov) {
+				gatherIov(block.data + off + a - start, iov, iovcnt, a - from, b - a);
+			} else {
+				memset(block.data + off + a - start, 0, b - a);
+			}
+		}
+		err = _writeBlock(l->bNum, &block);
+		if (IS_TFS_ERROR(err)) {
+			break;
+		}
+		written = 1;
+		if (inPlace) {
+			dedup_remove(l->bNum);
+		}
+		if (inPlace && l->next == next) {
+			continue;
+		}
+		if (next > 0) {
+			refCount[next]++;
+		}
+		if (inPlace && l->next > 0) {
+			drop[nDrop++] = l->next;
+		}
+	}
+	if (IS_TFS_ERROR(err)) {
+		// Once a link is written the new blocks may be in the chain
+		if (!written) {
+			releaseLinks(links, hi + 1, shared);
+			keepReserve(ip, drawn);
+		}
+		return err;
+	}
+	// Release the blocks no longer pointed at, only after every new link is counted
+	for (i = 0; i < nDrop; i++) {
+		err = freeBlocks(drop[i]);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+	}
+	return 0;
+}
+
+/* Write size bytes gathered from iov at the position of fp */
+int writeIov(FD* fp, const struct iovec* iov, int iovcnt, int size) {
+	Inode* ip = fp->ip;
+	if ((ip->flags & FLAG_ISDIR)) {
+		return ERR_ISDIR;
+	} else if ((ip->flags & FLAG_WRITE) == 0) {
+		return ERR_ACCESS;
+	} else if (size < 0 || fp->ptr < 0) {
+		return ERR_INVALID;
+	} else if (size == 0) {
+		return 0;
+	} else if (fp->ptr + size > MAX_FILE_SIZE) {
+		return ERR_OVERFLOW;
+	}
+	int err = unshareInode(ip);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	int end = fp->ptr + size;
+	int first = blockNum(fp->ptr), last = blockNum(end-1);
+	Link links[MAX_FILE_BLOCKS];
+	int n = loadChain(ip, links, last);
+	if (IS_TFS_ERROR(n)) {
+		return n;
+	}
+	n = fillChain(links, n, first, last);
+	int hi = 0;
+	while (links[hi].blk < last) {
+		hi++;
+	}
+	// Anything between the old end of file and ptr reads back as zeros
+	int zero = (ip->size < fp->ptr) ? ip->size : fp->ptr;
+	int oldSize = ip->size;
+	if (end > ip->size) {
+		ip->size = end;
+	}
+	err = writeChain(ip, links, n, hi, zero, iov, iovcnt, fp->ptr, end);
+	if (IS_TFS_ERROR(err)) {
+		ip->size = oldSize;
+		return err;
+	}
+	fp->ptr = end;
+	return 0;
+}
+
+int _tfs_write(fileDescriptor fd, char* buffer, int size) {
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	struct iovec iov = {buffer, size};
+	return writeIov(fp, &iov, 1, size);
+}
+
+/* Total length of iov, or an error if it is invalid */
+static int iovLength(const struct iovec* iov, int iovcnt) {
+	if (iovcnt < 0 || (iov == NULL && iovcnt > 0)) {
+		return ERR_INVALID;
+	}
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_base == NULL && iov[i].iov_len > 0) {
+			return ERR_FAULT;
+		}
+		total += iov[i].iov_len;
+		if (total > MAX_FILE_SIZE) {
+			return ERR_OVERFLOW;
+		}
+	}
+	return total;
+}
+
+int _tfs_writev(fileDescriptor fd, const struct iovec* iov, int iovcnt) {
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	int size = iovLength(iov, iovcnt);
+	if (IS_TFS_ERROR(size)) {
+		return size;
+	}
+	err = writeIov(fp, iov, iovcnt, size);
+	return IS_TFS_ERROR(err) ? err : size;
+}
+
+int _tfs_truncate(fileDescriptor fd, int len) {
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	Inode* ip = fp->ip;
+	if ((ip->flags & FLAG_ISDIR)) {
+		return ERR_ISDIR;
+	} else if ((ip->flags & FLAG_WRITE) == 0) {
+		return ERR_ACCESS;
+	} else if (len < 0) {
+		return ERR_INVALID;
+	} else if (len > MAX_FILE_SIZE) {
+		return ERR_OVERFLOW;
+	}
+	err = unshareInode(ip);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	// Zero the rest of the block holding the new or old end, whichever is first
+	int zero = (len < ip->size) ? len : ip->size;
+	int last = (len < ip->size) ? blockNum(len-1) : blockNum(zero);
+	Link links[MAX_FILE_BLOCKS];
+	int n = loadChain(ip, links, last);
+	if (IS_TFS_ERROR(n)) {
+		return n;
+	}
+	int hi = 0;
+	while (hi+1 < n && links[hi+1].blk <= last) {
+		hi++;
+	}
+	if (len < ip->size) {
+		// Drop everything after the last block kept
+		n = hi + 1;
+	}
+	int oldSize = ip->size;
+	ip->size = len;
+	int end = blockStart(blockNum(zero) + 1);
+	err = writeChain(ip, links, n, hi, zero, NULL, 0, end, end);
+	if (IS_TFS_ERROR(err)) {
+		ip->size = oldSize;
+		return err;
+	}
+	return 0;
+}
+
+int _tfs_fallocate(fileDescriptor fd, int len) {
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	Inode* ip = fp->ip;
+	if ((ip->flags & FLAG_ISDIR)) {
+		return ERR_ISDIR;
+	} else if ((ip->flags & FLAG_WRITE) == 0) {
+		return ERR_ACCESS;
+	} else if (len < 0) {
+		return ERR_INVALID;
+	} else if (len > MAX_FILE_SIZE) {
+		return ERR_OVERFLOW;
+	} else if (len == 0) {
+		return 0;
+	}
+	err = unshareInode(ip);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	int last = blockNum(len-1);
+	Link links[MAX_FILE_BLOCKS];
+	int n = loadChain(ip, links, last);
+	if (IS_TFS_ERROR(n)) {
+		return n;
+	}
+	n = fillChain(links, n, 0, last);
+	int hi = 0;
+	while (links[hi].blk < last) {
+		hi++;
+	}
+	// Place the links writeChain would allocate in one run when there is
+	// one, in file order, otherwise they are allocated one by one
+	int i, need = 0, shared = hi + 1;
+	for (i = 1; i <= hi; i++) {
+		if (shared > hi && links[i].old > 0 && refCount[links[i].old] > 1) {
+			shared = i;
+		}
+		if (links[i].old <= 0 || i >= shared) {
+			need++;
+		}
+	}
+	int run = (need > 0) ? bitset_find_run(superBlock.data+5, superBlock.data[4], need) : -1;
+	for (i = 1; i <= hi && run > 0; i++) {
+		if (links[i].old <= 0 || i >= shared) {
+			links[i].bNum = run++;
+		}
+	}
+	// Zero what lies past the old end in its block, like growing with truncate
+	int oldSize = ip->size;
+	int zero = (len > oldSize) ? oldSize : blockStart(last + 1);
+	int end = (len > oldSize) ? blockStart(blockNum(zero) + 1) : zero;
+	if (len > oldSize) {
+		ip->size = len;
+	}
+	err = writeChain(ip, links, n, hi, zero, NULL, 0, end, end);
+	if (IS_TFS_ERROR(err)) {
+		ip->size = oldSize;
+		return err;
+	}
+	return 0;
+}
+
+int _tfs_deleteFile(fileDescriptor fd) {
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	Inode* ip = fp->ip;
+	if ((ip->flags & FLAG_ISDIR)) {
+		return ERR_ISDIR;
+	} else if ((ip->flags & FLAG_WRITE) == 0) {
+		return ERR_ACCESS;
+	}
+	err = replaceEntry(&rootDir, ip->inode, 0);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	superBlock.data[SUPER_FILES]--;
+	drawReserve(ip, ip->reserved);
+	err = freeBlocks(ip->inode);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	// Other descriptors open on the file can only be closed now
+	unlinkInode(ip);
+	ip->inode = -1;
+	return _tfs_closeFile(fd);
+}
+
+/* Disk block holding block blk of ip, or 0 if it is a hole. Extends the
+block map from where the last walk stopped when blk is past it, leaving
+the last block walked in ip->buf. */
+int mapBlock(Inode* ip, int blk) {
+	int err, gap;
+	while (blk >= ip->mapEnd && ip->mapNext > 0) {
+		dbg("Reading next block %d\n", ip->mapNext);
+		err = _readBlock(ip->mapNext, &ip->buf);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		gap = ip->buf.data[3];
+		if (ip->mapEnd + 1 + gap > MAX_FILE_BLOCKS) {
+			return ERR_INVALID;
+		}
+		ip->blk = ip->mapEnd;
+		ip->map[ip->mapEnd++] = ip->mapNext;
+		memset(ip->map + ip->mapEnd, 0, gap);
+		ip->mapEnd += gap;
+		ip->mapNext = ip->buf.data[2];
+	}
+	return (blk < ip->mapEnd) ? ip->map[blk] : 0;
+}
+
+/* Load block blk of ip into ip->buf. Returns 1 if the block is allocated,
+or 0 if it is a hole. */
+int seekBlock(Inode* ip, int blk) {
+	int bNum = mapBlock(ip, blk);
+	if (bNum <= 0) {
+		return bNum;
+	}
+	if (ip->buf.bNum != bNum || ip->blk != blk) {
+		int err = _readBlock(bNum, &ip->buf);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		ip->blk = blk;
+	}
+	return 1;
+}
+
+int _tfs_readByte(fileDescriptor fd, char* buffer) {
+	dbg("reading byte\n");
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	Inode* ip = fp->ip;
+	if (ip->flags & FLAG_ISDIR) {
+		return ERR_ISDIR;
+	} else if (fp->ptr >= ip->size) {
+		return ERR_FAULT;
+	}
+	int idx = ptrIndex(fp->ptr, NULL);
+	err = seekBlock(ip, blockNum(fp->ptr));
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	// Holes read back as zeros
+	*buffer = err ? ip->buf.data[idx] : 0;
+	stats_add(bytesRead, 1);
+	dbg("block[%d] = '%c'\n", idx, *buffer);
+	++fp->ptr;
+	return 0;
+}
+
+/* Holes read back as zeros */
+static const char zeroBlock[BLOCKSIZE];
+
+int _tfs_readv(fileDescriptor fd, const struct iovec* iov, int iovcnt) {
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	Inode* ip = fp->ip;
+	if (ip->flags & FLAG_ISDIR) {
+		return ERR_ISDIR;
+	}
+	int size = iovLength(iov, iovcnt);
+	if (IS_TFS_ERROR(size)) {
+		return size;
+	}
+	int pos = fp->ptr, end = fp->ptr + size;
+	if (end > ip->size) {
+		end = ip->size;
+	}
+	// Copy straight from the cached blocks to the caller's buffers
+	while (pos < end) {
+		int idx = ptrIndex(pos, NULL);
+		int n = BLOCKSIZE - idx;
+		if (n > end - pos) {
+			n = end - pos;
+		}
+		int bNum = mapBlock(ip, blockNum(pos));
+		if (IS_TFS_ERROR(bNum)) {
+			return bNum;
+		} else if (bNum == 0) {
+			scatterIov((uint8_t*) zeroBlock, iov, iovcnt, pos - fp->ptr, n);
+		} else {
+			void* block;
+			err = pinBlock(mnt, bNum, &block);
+			if (IS_TFS_ERROR(err)) {
+				return err;
+			}
+			scatterIov((uint8_t*) block + idx, iov, iovcnt, pos - fp->ptr, n);
+			unpinBlock(block);
+		}
+		pos += n;
+	}
+	int done = (pos > fp->ptr) ? pos - fp->ptr : 0;
+	stats_add(bytesRead, done);
+	fp->ptr += done;
+	return done;
+}
+
+int _tfs_seek(FD* fp, int offset) {
+	if (offset >= fp->ip->size) {
+		fp->ptr = offset;
+		return 0;
+	}
+	int err = seekBlock(fp->ip, blockNum(offset));
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	fp->ptr = offset;
+	return 0;
+}
+
+/* Load the block of dir holding offset into dir->buf */
+int seekDir(File* dir, int offset) {
+	int blk = blockNum(offset), bNum = dir->inode;
+	for (int i = 0; i <= blk; i++) {
+		if (bNum <= 0) {
+			return ERR_EOF;
+		}
+		if (dir->buf.bNum != bNum) {
+			int err = _readBlock(bNum, &dir->buf);
+			if (IS_TFS_ERROR(err)) {
+				return err;
+			}
+		}
+		bNum = dir->buf.data[2];
+	}
+	dir->ptr = offset;
+	return 0;
+}
+
+int tfs_seek(fileDescriptor fd, int offset) {
+	uint64_t start = beginCall();
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (!IS_TFS_ERROR(err)) {
+		err = _tfs_seek(fp, offset);
+	}
+	return endCall(TFS_STAT_SEEK, start, fd, offset, err);
+}
+
+
+int _tfs_readMap(fileDescriptor fd, int offset, const char** ptr, int* len) {
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	Inode* ip = fp->ip;
+	if (ip->flags & FLAG_ISDIR) {
+		return ERR_ISDIR;
+	} else if (ptr == NULL || len == NULL) {
+		return ERR_FAULT;
+	} else if (offset < 0) {
+		return ERR_INVALID;
+	} else if (offset >= ip->size) {
+		return ERR_EOF;
+	}
+	int idx = ptrIndex(offset, NULL);
+	int n = BLOCKSIZE - idx;
+	if (n > ip->size - offset) {
+		n = ip->size - offset;
+	}
+	int bNum = mapBlock(ip, blockNum(offset));
+	if (IS_TFS_ERROR(bNum)) {
+		return bNum;
+	} else if (bNum == 0) {
+		*ptr = zeroBlock + idx;
 	} else {
-		bNum = fp->buf.data[2];
-		nBlocks = offBlock - ptrBlock;
+		void* block;
+		err = pinBlock(mnt, bNum, &block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		*ptr = (char*) block + idx;
+	}
+	*len = n;
+	return 0;
+}
+
+int _tfs_release(const char* ptr) {
+	if (ptr >= zeroBlock && ptr < zeroBlock + BLOCKSIZE) {
+		return 0;
+	}
+	return unpinBlock(ptr);
+}
+
+int _tfs_dedup(int enable) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	}
+	if (!enable) {
+		superBlock.data[SUPER_FEATURES] &= ~FEATURE_DEDUP;
+		dedup_reset();
+		return 0;
+	} else if (superBlock.data[SUPER_FEATURES] & FEATURE_DEDUP) {
+		return 0;
+	}
+	superBlock.data[SUPER_FEATURES] |= FEATURE_DEDUP;
+	// Index the extents already on disk
+	return countRefs();
+}
+
+int _tfs_saveImage(char* filename) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	} else if (batching) {
+		return ERR_TXTBUSY;
+	}
+	// The image must be mountable on its own, like after tfs_unmount
+	int err = writeBlock(mnt, SUPER_ADDRESS, superBlock.data);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	err = writeBlock(mnt, rootDir.buf.bNum, rootDir.buf.data);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	return saveDisk(mnt, filename);
+}
+
+int _tfs_discard(int enable) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	}
+	if (!enable) {
+		superBlock.data[SUPER_FEATURES] &= ~FEATURE_DISCARD;
+		return 0;
+	} else if (superBlock.data[SUPER_FEATURES] & FEATURE_DISCARD) {
+		return 0;
+	}
+	superBlock.data[SUPER_FEATURES] |= FEATURE_DISCARD;
+	// Give back the blocks freed before discarding was enabled
+	discardRuns(superBlock.data+5);
+	return 0;
+}
+
+int _tfs_beginBatch(void) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	} else if (batching) {
+		return ERR_INVALID;
+	}
+	int err = bufferWrites(mnt);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	batching = 1;
+	return 0;
+}
+
+int _tfs_commitBatch(void) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	} else if (!batching) {
+		return ERR_INVALID;
+	}
+	// Allocations only touch the bitmap in memory, make them durable too
+	int err = writeBlock(mnt, SUPER_ADDRESS, superBlock.data);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	err = writeBlock(mnt, rootDir.buf.bNum, rootDir.buf.data);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	err = flushWrites(mnt);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	batching = 0;
+	// The freed blocks are unused on disk now, unless the batch took them
+	// again
+	for (int i = 0; i < (MAX_BLOCKS >> 3); i++) {
+		batchDiscards[i] &= superBlock.data[5+i];
+	}
+	discardRuns(batchDiscards);
+	memset(batchDiscards, 0, sizeof(batchDiscards));
+	return 0;
+}
+
+/* Root directory entry tfs_defrag resumes at */
+int defragNext = 0;
+
+/* Read the chain starting at bNum into chain, returning its length, or
+0 when a block of it is shared and so cannot be moved */
+int readChain(int bNum, uint8_t* chain) {
+	uint8_t block[BLOCKSIZE];
+	int n = 0, shared = 0;
+	while (bNum > 0 && n < MAX_BLOCKS) {
+		int err = readBlock(mnt, bNum, block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		if (refCount[bNum] > 1) {
+			shared = 1;
+		}
+		chain[n++] = bNum;
+		bNum = block[2];
+	}
+	return shared ? 0 : n;
+}
+
+/* Copy the n blocks of chain to the free run of blocks starting at run,
+linking them in ascending order, then point the root directory entry
+and any open inode at the copy and free the original */
+int moveChain(uint8_t* chain, int n, int run) {
+	Block block;
+	int err, index = superBlock.data[SUPER_FEATURES] & FEATURE_DEDUP;
+	for (int i = 0; i < n; i++) {
+		err = _readBlock(chain[i], &block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		block.data[2] = (i < n-1) ? run+i+1 : 0;
+		err = _writeBlock(run+i, &block);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		useBlock(run+i);
+		refCount[run+i] = 1;
+		if (index && block.data[0] == BLOCK_EXTENT) {
+			dedup_insert(run+i, dedup_hash(block.data, BLOCKSIZE));
+		}
+	}
+	// The freed block nextFreeBlock remembers may be in the run
+	nextBlock = -1;
+	err = replaceEntry(&rootDir, chain[0], run);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	for (Inode* ip = inodeTable[chain[0]]; ip; ip = ip->next) {
+		if (ip->dir == rootDir.inode) {
+			unlinkInode(ip);
+			ip->inode = run;
+			linkInode(ip);
+			resetMap(ip);
+			break;
+		}
+	}
+	dbg("moved chain %d to %d-%d\n", chain[0], run, run+n-1);
+	return freeBlocks(chain[0]);
+}
+
+int _tfs_defrag(int budgetMs, int* score) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	}
+	uint8_t files[MAX_BLOCKS], chain[MAX_BLOCKS];
+	int entries[MAX_BLOCKS];
+	int i, n, err, nFiles = 0, entry = 0;
+	File dir = {0};
+	dir.inode = rootDir.inode;
+	dir.buf.bNum = -1;
+	err = seekDir(&dir, 0);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	char* name;
+	int bNum;
+	while ((bNum = nextFile(&dir, &name)) >= 0) {
+		if (bNum > 0 && nFiles < MAX_BLOCKS) {
+			files[nFiles] = bNum;
+			entries[nFiles++] = entry;
+		}
+		entry++;
+	}
+	if (bNum != ERR_EOF) {
+		return bNum;
+	}
+
+	// Resume at the entry the last call stopped at
+	int first = 0;
+	while (first < nFiles && entries[first] < defragNext) {
+		first++;
+	}
+	if (first == nFiles) {
+		first = 0;
+	}
+	uint64_t deadline = trace_now() + (uint64_t) (budgetMs > 0 ? budgetMs : 0) * 1000000;
+	int done = 1;
+	for (int k = 0; k < nFiles && budgetMs > 0; k++) {
+		int f = (first + k) % nFiles;
+		if (trace_now() >= deadline) {
+			defragNext = entries[f];
+			done = 0;
+			break;
+		}
+		if ((n = readChain(files[f], chain)) < 0) {
+			return n;
+		}
+		for (i = 1; i < n && chain[i] == chain[i-1]+1; i++);
+		if (i >= n) {
+			// Already contiguous, or shared with a snapshot
+			continue;
+		}
+		int run = bitset_find_run(superBlock.data+5, superBlock.data[4], n);
+		if (run < START_ADDRESS) {
+			dbg("no run of %d free blocks for %d\n", n, files[f]);
+			continue;
+		}
+		err = moveChain(chain, n, run);
+		if (IS_TFS_ERROR(err)) {
+			return err;
+		}
+		files[f] = run;
+	}
+	if (done && budgetMs > 0) {
+		defragNext = 0;
+	}
+
+	if (score) {
+		int links = 0, breaks = 0;
+		uint8_t block[BLOCKSIZE];
+		for (int f = 0; f < nFiles; f++) {
+			for (i = 0, bNum = files[f]; bNum > 0 && i < MAX_BLOCKS; i++, bNum = block[2]) {
+				err = readBlock(mnt, bNum, block);
+				if (IS_TFS_ERROR(err)) {
+					return err;
+				}
+				if (block[2] > 0) {
+					links++;
+					breaks += (block[2] != bNum+1);
+				}
+			}
+		}
+		*score = links ? breaks * 100 / links : 0;
+	}
+	return !done;
+}
+
+struct tfsDir {
+	int inode;
+	/* Offset of the next entry to read */
+	int ptr;
+};
+
+int _tfs_openDir(char* path, tfsDir** dirp) {
+	if (mnt < 0) {
+		return ERR_IO;
+	} else if (path == NULL || dirp == NULL) {
+		return ERR_FAULT;
+	}
+	while (*path == '/') {
+		path++;
+	}
+	if (*path != '\0') {
+		// Only the root directory exists
+		return ERR_INVALID;
+	}
+	tfsDir* dir = malloc(sizeof(tfsDir));
+	if (dir == NULL) {
+		return ERR_NOMEMORY;
+	}
+	dir->inode = rootDir.inode;
+	dir->ptr = 0;
+	*dirp = dir;
+	return 0;
+}
+
+/* Fill st from the inode block bNum */
+int statInode(int bNum, struct tfs_stat* st) {
+	File file;
+	int err = readInode(bNum, &file);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	st->inode = bNum;
+	st->size = file.size;
+	st->flags = file.flags;
+	return 0;
+}
+
+/* Read the next entry of dir, and stat it too if st is not NULL. The
+stream remembers its place by offset, so entries created or deleted
+meanwhile do not disturb it. */
+int _tfs_readDir(tfsDir* dir, struct tfs_dirent* ent, struct tfs_stat* st) {
+	if (mnt < 0) {
+		return ERR_IO;
+	} else if (dir == NULL || ent == NULL) {
+		return ERR_FAULT;
+	}
+	File d = {0};
+	d.inode = dir->inode;
+	d.buf.bNum = -1;
+	int err = seekDir(&d, dir->ptr);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	char* name;
+	int bNum;
+	while ((bNum = nextFile(&d, &name)) == 0);
+	if (IS_TFS_ERROR(bNum)) {
+		return bNum;
+	}
+	dir->ptr = d.ptr;
+	memcpy(ent->name, name, MAX_FILENAME_SIZE);
+	ent->name[MAX_FILENAME_SIZE] = '\0';
+	ent->inode = bNum;
+	return st ? statInode(bNum, st) : 0;
+}
+
+int _tfs_stat(char* path, struct tfs_stat* st) {
+	if (mnt < 0) {
+		return ERR_IO;
+	} else if (path == NULL || st == NULL) {
+		return ERR_FAULT;
+	}
+	while (*path == '/') {
+		path++;
+	}
+	if (*path == '\0') {
+		return statInode(rootDir.inode, st);
+	} else if (strlen(path) > MAX_FILENAME_SIZE) {
+		return ERR_NAMETOOLONG;
+	}
+	File file = {0};
+	int bNum = findFileInDir(path, &file, &rootDir);
+	if (IS_TFS_ERROR(bNum)) {
+		return bNum;
+	} else if (bNum == 0) {
+		return ERR_INVALID;
+	}
+	st->inode = bNum;
+	st->size = file.size;
+	st->flags = file.flags;
+	return 0;
+}
+
+/* Find the snapshot table entry named name, or the first free entry when
+name is NULL */
+uint8_t* findSnapshot(char* name) {
+	uint8_t* entry = superBlock.data + SUPER_SNAPSHOTS;
+	for (int i = 0; i < MAX_SNAPSHOTS; i++, entry += ENTRY_SIZE) {
+		if (name == NULL) {
+			if (entry[MAX_FILENAME_SIZE] == 0) {
+				return entry;
+			}
+		} else if (entry[MAX_FILENAME_SIZE] > 0 && strncmp(name, (char*) entry, MAX_FILENAME_SIZE) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+int _tfs_snapshot(char* name) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	}
+	int nameSize = strlen(name);
+	if (nameSize == 0) {
+		return ERR_INVALID;
+	} else if (nameSize > MAX_FILENAME_SIZE) {
+		return ERR_NAMETOOLONG;
+	} else if (findSnapshot(name)) {
+		return ERR_INVALID;
 	}
-	int err;
-	while (bNum > 0 && nBlocks > 0) {
-		err = readBlock(mnt, bNum, fp->buf.data);
+	uint8_t* entry = findSnapshot(NULL);
+	if (entry == NULL) {
+		return ERR_MFILES;
+	}
+	Block snap;
+	int err = _readBlock(ROOT_ADDRESS, &snap);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	// The copy adds one reference to everything the root block points at
+	int idx, addr;
+	for (idx = INODE_HEADER_SIZE; idx + ENTRY_SIZE <= BLOCKSIZE; idx += ENTRY_SIZE) {
+		addr = snap.data[idx + MAX_FILENAME_SIZE];
+		if (addr > 0 && refCount[addr] == UCHAR_MAX) {
+			return ERR_OVERFLOW;
+		}
+	}
+	if (snap.data[2] > 0 && refCount[snap.data[2]] == UCHAR_MAX) {
+		return ERR_OVERFLOW;
+	}
+	int bNum = nextFreeBlock();
+	if (bNum <= 0) {
+		return ERR_NOMEMORY;
+	}
+	idx = BLOCK_HEADER_SIZE + 1;
+	memset(snap.data+idx, 0, MAX_FILENAME_SIZE);
+	memcpy(snap.data+idx, name, nameSize);
+	snap.data[INODE_HEADER_SIZE-1] = FLAGS_SNAPSHOT;
+	err = _writeBlock(bNum, &snap);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	useBlock(bNum);
+	refCount[bNum] = 1;
+	for (idx = INODE_HEADER_SIZE; idx + ENTRY_SIZE <= BLOCKSIZE; idx += ENTRY_SIZE) {
+		addr = snap.data[idx + MAX_FILENAME_SIZE];
+		if (addr > 0) {
+			refCount[addr]++;
+		}
+	}
+	if (snap.data[2] > 0) {
+		refCount[snap.data[2]]++;
+	}
+	memset(entry, 0, MAX_FILENAME_SIZE);
+	memcpy(entry, name, nameSize);
+	entry[MAX_FILENAME_SIZE] = bNum;
+	// The snapshot holds the names the root holds now
+	bloom_t* names = nameFilter(rootDir.inode, 0);
+	if (names && nameFilter(bNum, 1)) {
+		*nameFilters[bNum] = *names;
+	}
+	dbg("snapshot %s at block %d\n", name, bNum);
+	return 0;
+}
+
+fileDescriptor _tfs_openSnapshot(char* snapshot, char* name) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	}
+	uint8_t* entry = findSnapshot(snapshot);
+	if (entry == NULL) {
+		return ERR_INVALID;
+	}
+	if (name[0] == '/') {
+		++name;
+	}
+	int nameSize = strlen(name);
+	if (nameSize == 0) {
+		return ERR_INVALID;
+	} else if (nameSize > MAX_FILENAME_SIZE) {
+		return ERR_NAMETOOLONG;
+	}
+	File dir = {0};
+	dir.inode = entry[MAX_FILENAME_SIZE];
+	dir.buf.bNum = -1;
+	File file = {0};
+	memcpy(file.name, name, nameSize);
+	int bNum = findFileInDir(name, &file, &dir);
+	if (IS_TFS_ERROR(bNum)) {
+		return bNum;
+	} else if (bNum == 0) {
+		return ERR_INVALID;
+	}
+	// Snapshots are read only
+	file.dir = dir.inode;
+	file.flags &= ~FLAG_WRITE;
+	return openFD(&file);
+}
+
+int _tfs_deleteSnapshot(char* name) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	}
+	uint8_t* entry = findSnapshot(name);
+	if (entry == NULL) {
+		return ERR_INVALID;
+	}
+	File dir = {0};
+	dir.inode = entry[MAX_FILENAME_SIZE];
+	dir.buf.bNum = -1;
+	// Files open in the snapshot can only be closed now
+	Inode* ip;
+	for (int i = 0; i < MAX_BLOCKS; i++) {
+		for (Inode** pp = &inodeTable[i]; (ip = *pp); ) {
+			if (ip->dir == dir.inode) {
+				*pp = ip->next;
+				ip->next = NULL;
+				ip->inode = -1;
+			} else {
+				pp = &ip->next;
+			}
+		}
+	}
+	int err, bNum;
+	char* namep;
+	if (refCount[dir.inode] <= 1) {
+		// Last reference to the snapshot dir, release what it points at
+		err = _readBlock(dir.inode, &dir.buf);
 		if (IS_TFS_ERROR(err)) {
 			return err;
 		}
-		fp->buf.bNum = bNum;
-		bNum = fp->buf.data[2];
-		nBlocks -= 1;
+		dir.ptr = 0;
+		while ((bNum = nextFile(&dir, &namep)) >= 0) {
+			if (bNum > 0) {
+				err = freeBlocks(bNum);
+				if (IS_TFS_ERROR(err)) {
+					return err;
+				}
+			}
+		}
+		if (bNum != ERR_EOF) {
+			return bNum;
+		}
+		free(nameFilters[dir.inode]);
+		nameFilters[dir.inode] = NULL;
 	}
-	fp->ptr = offset;
+	err = freeBlocks(dir.inode);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	memset(entry, 0, ENTRY_SIZE);
 	return 0;
 }
 
-int tfs_seek(fileDescriptor fd, int offset) {
-	File* fp;
+/* Create ‘name’ in the root directory as a copy of the file open as fd.
+Only the inode block is copied, the rest of the chain gains a reference
+and is copied by the write path when either file next writes it. */
+fileDescriptor _tfs_clone(fileDescriptor fd, char* name) {
+	FD* fp;
+	int err = getFile(fd, &fp);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	Inode* ip = fp->ip;
+	if ((ip->flags & FLAG_ISDIR)) {
+		return ERR_ISDIR;
+	}
+	int nameSize = strlen(name);
+	if (nameSize == 0) {
+		return ERR_INVALID;
+	} else if (nameSize > MAX_FILENAME_SIZE) {
+		return ERR_NAMETOOLONG;
+	}
+	File file = {0};
+	memcpy(file.name, name, nameSize);
+	int bNum = findFile(&file);
+	if (IS_TFS_ERROR(bNum)) {
+		return bNum;
+	} else if (bNum > 0) {
+		return ERR_INVALID;
+	}
+	err = _readBlock(ip->inode, &file.buf);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	int next = file.buf.data[2];
+	if (next > 0 && refCount[next] == UCHAR_MAX) {
+		return ERR_OVERFLOW;
+	}
+	if ((bNum = findOrMakeFile(name, &rootDir)) <= 0) {
+		return IS_TFS_ERROR(bNum) ? bNum : ERR_NOMEMORY;
+	}
+	int idx = BLOCK_HEADER_SIZE;
+	file.buf.data[idx] = rootDir.inode;
+	memcpy(file.buf.data+idx+1, file.name, MAX_FILENAME_SIZE);
+	err = _writeBlock(bNum, &file.buf);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	useBlock(bNum);
+	refCount[bNum] = 1;
+	if (next > 0) {
+		refCount[next]++;
+	}
+	superBlock.data[SUPER_FILES]++;
+	dbg("cloned inode %d to %d\n", ip->inode, bNum);
+	err = readInode(bNum, &file);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	return openFD(&file);
+}
+
+/* Set the reservation of the file open as fd to nBlocks */
+int _tfs_reserve(fileDescriptor fd, int nBlocks) {
+	FD* fp;
 	int err = getFile(fd, &fp);
 	if (IS_TFS_ERROR(err)) {
 		return err;
 	}
-	return _tfs_seek(fp, offset);
+	Inode* ip = fp->ip;
+	if ((ip->flags & FLAG_ISDIR)) {
+		return ERR_ISDIR;
+	} else if ((ip->flags & FLAG_WRITE) == 0) {
+		return ERR_ACCESS;
+	} else if (nBlocks < 0) {
+		return ERR_INVALID;
+	} else if (nBlocks - ip->reserved > freeCount()) {
+		return ERR_NOMEMORY;
+	}
+	reservedBlocks += nBlocks - ip->reserved;
+	ip->reserved = nBlocks;
+	return 0;
+}
+
+int _tfs_statfs(struct tfs_statfs* st) {
+	if (mnt < 0) {
+		return ERR_BADF;
+	} else if (st == NULL) {
+		return ERR_FAULT;
+	}
+	st->blockSize = BLOCKSIZE;
+	st->blocks = superBlock.data[4];
+	st->freeBlocks = superBlock.data[SUPER_FREE];
+	st->availBlocks = freeCount();
+	st->files = superBlock.data[SUPER_FILES];
+	return 0;
+}
+
+int tfs_stats(struct tfs_stats* stats) {
+	if (stats == NULL) {
+		return ERR_FAULT;
+	}
+	stats_sum(stats);
+	return 0;
+}
+
+int tfs_resetStats(void) {
+	stats_reset();
+	return 0;
+}
+
+/* Held by every public call, the file system state is not otherwise
+safe to share between threads */
+pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;
+
+int tfs_traceStart(char* filename, int records) {
+	pthread_mutex_lock(&fsLock);
+	int err = trace_start(filename, records);
+	pthread_mutex_unlock(&fsLock);
+	return err;
+}
+
+int tfs_traceStop(void) {
+	pthread_mutex_lock(&fsLock);
+	int err = trace_stop();
+	pthread_mutex_unlock(&fsLock);
+	return err;
+}
+
+int tfs_release(const char* ptr) {
+	pthread_mutex_lock(&fsLock);
+	int err = _tfs_release(ptr);
+	pthread_mutex_unlock(&fsLock);
+	return err;
+}
+
+int tfs_dedup(int enable) {
+	pthread_mutex_lock(&fsLock);
+	int err = _tfs_dedup(enable);
+	pthread_mutex_unlock(&fsLock);
+	return err;
+}
+
+int tfs_saveImage(char* filename) {
+	pthread_mutex_lock(&fsLock);
+	int err = _tfs_saveImage(filename);
+	pthread_mutex_unlock(&fsLock);
+	return err;
+}
+
+int tfs_loadImage(char* filename, char* diskname) {
+	pthread_mutex_lock(&fsLock);
+	int err = loadDisk(filename, diskname);
+	pthread_mutex_unlock(&fsLock);
+	return err;
+}
+
+int tfs_discard(int enable) {
+	pthread_mutex_lock(&fsLock);
+	int err = _tfs_discard(enable);
+	pthread_mutex_unlock(&fsLock);
+	return err;
+}
+
+/* Public entry points, timed for tfs_stats and traced */
+
+/* Take the lock for a call, returns when it started */
+static uint64_t beginCall(void) {
+	uint64_t start = stats_start();
+	pthread_mutex_lock(&fsLock);
+	return start;
+}
+
+/* Count and trace a call that began at start and returned ret */
+static int endCall(int op, uint64_t start, int fd, int size, int ret) {
+	trace(op, start, -1, fd, size, ret);
+	pthread_mutex_unlock(&fsLock);
+	return stats_end(op, start, ret);
+}
+
+int tfs_mkfs(char* filename, int nBytes) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_MKFS, start, -1, nBytes, _tfs_mkfs(filename, nBytes, 0));
+}
+
+int tfs_mkfsFlags(char* filename, int nBytes, int flags) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_MKFS, start, -1, nBytes, _tfs_mkfs(filename, nBytes, flags));
+}
+
+int tfs_mount(char* diskname) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_MOUNT, start, -1, 0, _tfs_mount(diskname, 0));
+}
+
+int tfs_mountFlags(char* diskname, int flags) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_MOUNT, start, -1, flags, _tfs_mount(diskname, flags));
+}
+
+int tfs_unmount(void) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_UNMOUNT, start, -1, 0, _tfs_unmount());
+}
+
+fileDescriptor tfs_openFile(char* name) {
+	uint64_t start = beginCall();
+	fileDescriptor fd = _tfs_openFile(name);
+	FD* fp;
+	if (tracing && getFile(fd, &fp) == 0) {
+		trace(TFS_STAT_OPEN, start, fp->ip->inode, fd, 0, fd);
+	} else {
+		trace(TFS_STAT_OPEN, start, -1, -1, 0, fd);
+	}
+	pthread_mutex_unlock(&fsLock);
+	return stats_end(TFS_STAT_OPEN, start, fd);
+}
+
+int tfs_closeFile(fileDescriptor fd) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_CLOSE, start, fd, 0, _tfs_closeFile(fd));
+}
+
+int tfs_writeFile(fileDescriptor fd, char* buffer, int size) {
+	uint64_t start = beginCall();
+	int err = _tfs_writeFile(fd, buffer, size);
+	if (err == 0) {
+		stats_add(bytesWritten, size);
+	}
+	return endCall(TFS_STAT_WRITE_FILE, start, fd, size, err);
+}
+
+int tfs_write(fileDescriptor fd, char* buffer, int size) {
+	uint64_t start = beginCall();
+	int err = _tfs_write(fd, buffer, size);
+	if (err == 0) {
+		stats_add(bytesWritten, size);
+	}
+	return endCall(TFS_STAT_WRITE, start, fd, size, err);
+}
+
+int tfs_truncate(fileDescriptor fd, int len) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_TRUNCATE, start, fd, len, _tfs_truncate(fd, len));
+}
+
+int tfs_deleteFile(fileDescriptor fd) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_DELETE, start, fd, 0, _tfs_deleteFile(fd));
+}
+
+int tfs_readByte(fileDescriptor fd, char* buffer) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_READ_BYTE, start, fd, 1, _tfs_readByte(fd, buffer));
+}
+
+int tfs_snapshot(char* name) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_SNAPSHOT, start, -1, 0, _tfs_snapshot(name));
+}
+
+int tfs_writev(fileDescriptor fd, const struct iovec* iov, int iovcnt) {
+	uint64_t start = beginCall();
+	int ret = _tfs_writev(fd, iov, iovcnt);
+	if (ret > 0) {
+		stats_add(bytesWritten, ret);
+	}
+	return endCall(TFS_STAT_WRITEV, start, fd, iovLength(iov, iovcnt), ret);
+}
+
+int tfs_readv(fileDescriptor fd, const struct iovec* iov, int iovcnt) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_READV, start, fd, iovLength(iov, iovcnt), _tfs_readv(fd, iov, iovcnt));
+}
+
+int tfs_readMap(fileDescriptor fd, int offset, const char** ptr, int* len) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_READ_MAP, start, fd, offset, _tfs_readMap(fd, offset, ptr, len));
+}
+
+fileDescriptor tfs_openSnapshot(char* snapshot, char* name) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_OPEN_SNAPSHOT, start, -1, 0, _tfs_openSnapshot(snapshot, name));
+}
+
+int tfs_deleteSnapshot(char* name) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_DELETE_SNAPSHOT, start, -1, 0, _tfs_deleteSnapshot(name));
+}
+
+int tfs_beginBatch(void) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_BATCH_BEGIN, start, -1, 0, _tfs_beginBatch());
+}
+
+int tfs_commitBatch(void) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_BATCH_COMMIT, start, -1, 0, _tfs_commitBatch());
+}
+
+int tfs_resize(int nBytes) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_RESIZE, start, -1, nBytes, _tfs_resize(nBytes));
+}
+
+int tfs_resizeImage(char* filename, int nBytes) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_RESIZE_IMAGE, start, -1, nBytes, _tfs_resizeImage(filename, nBytes));
+}
+
+fileDescriptor tfs_clone(fileDescriptor fd, char* name) {
+	uint64_t start = beginCall();
+	fileDescriptor newFD = _tfs_clone(fd, name);
+	FD* fp;
+	if (tracing && getFile(newFD, &fp) == 0) {
+		trace(TFS_STAT_CLONE, start, fp->ip->inode, fd, 0, newFD);
+	} else {
+		trace(TFS_STAT_CLONE, start, -1, fd, 0, newFD);
+	}
+	pthread_mutex_unlock(&fsLock);
+	return stats_end(TFS_STAT_CLONE, start, newFD);
+}
+
+int tfs_fallocate(fileDescriptor fd, int len) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_FALLOCATE, start, fd, len, _tfs_fallocate(fd, len));
+}
+
+int tfs_reserve(fileDescriptor fd, int nBlocks) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_RESERVE, start, fd, nBlocks, _tfs_reserve(fd, nBlocks));
+}
+
+int tfs_statfs(struct tfs_statfs* st) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_STATFS, start, -1, 0, _tfs_statfs(st));
+}
+
+int tfs_defrag(int budgetMs, int* score) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_DEFRAG, start, -1, budgetMs, _tfs_defrag(budgetMs, score));
+}
+
+int tfs_openDir(char* path, tfsDir** dirp) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_OPEN_DIR, start, -1, 0, _tfs_openDir(path, dirp));
+}
+
+int tfs_readDir(tfsDir* dir, struct tfs_dirent* ent) {
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_READ_DIR, start, -1, 0, _tfs_readDir(dir, ent, NULL));
+}
+
+int tfs_readDirPlus(tfsDir* dir, struct tfs_dirent* ent, struct tfs_stat* st) {
+	if (st == NULL) {
+		return ERR_FAULT;
+	}
+	uint64_t start = beginCall();
+	return endCall(TFS_STAT_READ_DIR, start, -1, 0, _tfs_readDir(dir, ent, st));
+}
+
+int tfs_closeDir(tfsDir* dir) {
+	if (dir == NULL) {
+		return ERR_FAULT;
+	}
+	free(dir);
+	return 0;
+}
+
+int tfs_stat(char* path, struct tfs_stat* st) {
+	uint64_t start = beginCall();
+	int err = _tfs_stat(path, st);
+	trace(TFS_STAT_STAT, start, (err == 0) ? st->inode : -1, -1, 0, err);
+	pthread_mutex_unlock(&fsLock);
+	return stats_end(TFS_STAT_STAT, start, err);
+}
+
+/* Run a submitted request on a worker through the public calls, so it
+is counted and traced like them */
+static void runRequest(request* r) {
+	struct iovec iov = {r->buf, r->len};
+	uint64_t start;
+	FD* fp;
+	int op, ptr, err;
+	switch (r->ev.op) {
+		case TFS_OP_READ:
+		case TFS_OP_WRITE:
+			if (r->offset < 0) {
+				err = (r->ev.op == TFS_OP_READ) ? tfs_readv(r->ev.fd, &iov, 1) : tfs_writev(r->ev.fd, &iov, 1);
+				break;
+			}
+			op = (r->ev.op == TFS_OP_READ) ? TFS_STAT_READV : TFS_STAT_WRITEV;
+			start = beginCall();
+			if (IS_TFS_ERROR(err = getFile(r->ev.fd, &fp))) {
+				err = endCall(op, start, r->ev.fd, r->len, err);
+				break;
+			}
+			// Reads and writes at an offset leave the file pointer alone.
+			// They are traced as a seek there and back around the call, so
+			// a replay repeats them in place.
+			ptr = fp->ptr;
+			fp->ptr = r->offset;
+			trace(TFS_STAT_SEEK, start, -1, r->ev.fd, r->offset, 0);
+			if (op == TFS_STAT_READV) {
+				err = _tfs_readv(r->ev.fd, &iov, 1);
+			} else if ((err = _tfs_writev(r->ev.fd, &iov, 1)) > 0) {
+				stats_add(bytesWritten, err);
+			}
+			fp->ptr = ptr;
+			trace(op, start, -1, r->ev.fd, r->len, err);
+			trace(TFS_STAT_SEEK, start, -1, r->ev.fd, ptr, 0);
+			pthread_mutex_unlock(&fsLock);
+			err = stats_end(op, start, err);
+			break;
+		case TFS_OP_OPEN:
+			err = tfs_openFile(r->buf);
+			break;
+		case TFS_OP_CLOSE:
+			err = tfs_closeFile(r->ev.fd);
+			break;
+		case TFS_OP_DELETE:
+			err = tfs_deleteFile(r->ev.fd);
+			break;
+		default:
+			err = ERR_INVALID;
+	}
+	r->ev.res = err;
+}
+
+int tfs_submit(int op, fileDescriptor fd, void* buf, int len, int offset, void* userData) {
+	if (op < TFS_OP_READ || op > TFS_OP_DELETE) {
+		return ERR_INVALID;
+	} else if ((op == TFS_OP_READ || op == TFS_OP_WRITE) && (len < 0 || (buf == NULL && len > 0))) {
+		return ERR_INVALID;
+	} else if (op == TFS_OP_OPEN && buf == NULL) {
+		return ERR_FAULT;
+	}
+	int err = async_start(ASYNC_WORKERS, runRequest);
+	if (IS_TFS_ERROR(err)) {
+		return err;
+	}
+	return async_submit(op, fd, buf, len, offset, userData);
+}
+
+int tfs_reap(struct tfs_event* events, int max) {
+	if (events == NULL || max < 0) {
+		return ERR_INVALID;
+	}
+	return async_reap(events, max);
 }
 
+int tfs_completionFD(void) {
+	int err = async_start(ASYNC_WORKERS, runRequest);
+	return IS_TFS_ERROR(err) ? err : async_fd();
+}
@@ -1,8 +1,14 @@
 #ifndef LIBTINYFS_H
 #define LIBTINYFS_H
 
+#include <sys/uio.h>
+
 #include "libDisk.h"
 #include "tinyFS.h"
+#include "tinyFS_async.h"
+#include "tinyFS_dir.h"
+#include "tinyFS_stats.h"
+#include "tinyFS_trace.h"
 
 /* Makes a blank TinyFS file system of size nBytes on the unix file
 specified by ‘filename’. This function should use the emulated disk
@@ -12,6 +18,16 @@ setting magic numbers, initializing and writing the superblock and
 inodes, etc. Must return a specified success/error code. */
 int tfs_mkfs(char* filename, int nBytes);
 
+/* Makes a file system like tfs_mkfs, with ‘flags’. TFS_MKFS_ITABLE adds
+an inode table: dense blocks packing the size, flags and parent of 42
+inodes each, kept up to date as inodes are written. Opening, statting
+and listing files then read the table rather than each file's inode
+block, so scanning metadata touches a few blocks that stay cached. The
+table only mirrors the inodes, which stay authoritative: a disk whose
+table chain is damaged fails to mount with ERR_INVALID until ‘tfsck -r’
+drops the table, after which it mounts and reads the inodes directly. */
+int tfs_mkfsFlags(char* filename, int nBytes, int flags);
+
 /* tfs_mount(char *diskname) “mounts” a TinyFS file system located within
 ‘diskname’. tfs_unmount(void) “unmounts” the currently mounted file
 system. As part of the mount operation, tfs_mount should verify the file
@@ -21,6 +37,19 @@ mounted file system. Must return a specified success/error code. */
 int tfs_mount(char* diskname);
 int tfs_unmount(void);
 
+/* A disk name starting with "mem:" (e.g. "mem:scratch") names a RAM disk
+that lives in memory until the process exits, see openDisk. tfs_saveImage
+writes the mounted RAM disk to the host file ‘filename’ in one sequential
+write, as an image tfs_mount can mount directly. tfs_loadImage reads such
+an image, or any disk file, into the RAM disk ‘diskname’ for mounting. */
+int tfs_saveImage(char* filename);
+int tfs_loadImage(char* filename, char* diskname);
+
+/* Mounts like tfs_mount, with ‘flags’. TFS_MOUNT_DIRECT bypasses the
+host's page cache so blocks are only cached once, by TinyFS itself. The
+disk size must then be a multiple of 4096 bytes. */
+int tfs_mountFlags(char* diskname, int flags);
+
 /* Creates or Opens a file for reading and writing on the currently
 mounted file system. Creates a dynamic resource table entry for the file,
 and returns a file descriptor (integer) that can be used to reference
@@ -37,6 +66,33 @@ completely lost. Sets the file pointer to 0 (the start of file) when
 done. Returns success/error codes. */
 int tfs_writeFile(fileDescriptor fd, char* buffer, int size);
 
+/* Writes ‘size’ bytes of ‘buffer’ at the current file pointer, growing
+the file if needed, and advances the file pointer past them. Writing
+past the end of the file leaves a hole: the skipped range reads back as
+zeros and only the blocks actually written are allocated. */
+int tfs_write(fileDescriptor fd, char* buffer, int size);
+
+/* Sets the size of the file to ‘len’ bytes. Shrinking frees every block
+past the new end in one pass, growing adds a hole that reads back as
+zeros without allocating any blocks. The file pointer is unchanged. */
+int tfs_truncate(fileDescriptor fd, int len);
+
+/* Allocates every block of the first ‘len’ bytes of the file that is not
+allocated yet, growing the file to ‘len’ bytes if it is shorter. New
+blocks read back as zeros and are taken from one run of consecutive
+free blocks when the disk has one. Writes within ‘len’ then allocate
+nothing, so they cannot run out of space, unless a snapshot or clone
+has come to share the blocks since. */
+int tfs_fallocate(fileDescriptor fd, int len);
+
+/* Holds back ‘nBlocks’ free blocks for writes to the file open as ‘fd’,
+replacing what it held before (0 gives it all back). Writes to the file
+allocate from its reservation first, and no other file can allocate
+reserved blocks, so a writer that reserves what it needs cannot run out
+of space partway. Fails if there are not enough unreserved free blocks.
+The reservation ends when the file's last descriptor is closed. */
+int tfs_reserve(fileDescriptor fd, int nBlocks);
+
 /* deletes a file and marks its blocks as free on disk. */
 int tfs_deleteFile(fileDescriptor fd);
 
@@ -50,6 +106,148 @@ int tfs_readByte(fileDescriptor fd, char* buffer);
 success/error codes. */
 int tfs_seek(fileDescriptor fd, int offset);
 
+/* Enables or disables block deduplication on the mounted file system.
+While enabled, tfs_writeFile shares any extent block that is identical
+to one already on disk instead of allocating a new one. Shared blocks are
+reference counted and copied before they are overwritten, so files
+written with dedup enabled stay correct after it is disabled. The setting
+is stored in the superblock. */
+int tfs_dedup(int enable);
+
+/* Enables or disables discarding on the mounted file system. While
+enabled, blocks freed by deletes, truncates and rewrites are punched out
+of the disk file, in runs of consecutive blocks, so the host reclaims
+their storage. Enabling it discards every block that is already free.
+Blocks freed inside a batch are only punched out when it is committed.
+The setting is stored in the superblock. */
+int tfs_discard(int enable);
+
+/* Takes a read-only, point-in-time snapshot of the mounted file system
+named ‘name’. Only the root directory block is copied, every file stays
+shared with the snapshot until it is next written, when the written
+blocks are copied first. Up to 8 snapshots can exist at a time. */
+int tfs_snapshot(char* name);
+
+/* Opens ‘name’ as it was when ‘snapshot’ was taken. The returned file
+descriptor is read only, and is used like any other while the live file
+system keeps taking writes. */
+fileDescriptor tfs_openSnapshot(char* snapshot, char* name);
+
+/* Deletes a snapshot, closing any files open in it and freeing the
+blocks no longer shared with the live file system or other snapshots. */
+int tfs_deleteSnapshot(char* name);
+
+/* Creates ‘name’ as a copy of the file open as ‘fd’ and opens it. The
+copy shares the source's blocks, each is copied only when either file
+first writes it. Cloning a file open in a snapshot restores it. */
+fileDescriptor tfs_clone(fileDescriptor fd, char* name);
+
+/* Fills ‘stats’ with the counters gathered since the last tfs_resetStats:
+calls, errors and a log2 latency histogram for each API call, plus block
+reads/writes, block cache hits/misses, file bytes moved and free block
+bitmap scans. Counters are kept per thread and summed here, so counting
+adds no locking to the calls themselves. */
+int tfs_stats(struct tfs_stats* stats);
+
+/* Starts the counters reported by tfs_stats over from zero. */
+int tfs_resetStats(void);
+
+/* Write the buffers of ‘iov’, in order, at the current file pointer
+as tfs_write() would their concatenation, without staging them in one
+buffer. Returns the number of bytes written. */
+int tfs_writev(fileDescriptor fd, const struct iovec* iov, int iovcnt);
+
+/* Read from the current file pointer into the buffers of ‘iov’ in
+order, advancing the pointer. Returns the number of bytes read, less
+than requested at the end of the file and 0 past it. */
+int tfs_readv(fileDescriptor fd, const struct iovec* iov, int iovcnt);
+
+/* Opens a stream over the entries of the directory ‘path’ (only "/"
+exists for now). tfs_readDir reads the next entry, returning ERR_EOF
+after the last one, and tfs_readDirPlus also stats it in the same pass.
+Entries created or deleted while a stream is open may or may not be
+returned, but no other entry is skipped or repeated. */
+int tfs_openDir(char* path, tfsDir** dirp);
+int tfs_readDir(tfsDir* dir, struct tfs_dirent* ent);
+int tfs_readDirPlus(tfsDir* dir, struct tfs_dirent* ent, struct tfs_stat* st);
+int tfs_closeDir(tfsDir* dir);
+
+/* Fills ‘st’ with the inode, size and flags of the file at ‘path’
+without opening it. */
+int tfs_stat(char* path, struct tfs_stat* st);
+
+/* Fills ‘st’ with the size, free and unreserved block counts and number
+of files of the mounted file system. The counts are kept up to date in
+the superblock, so this scans nothing. */
+int tfs_statfs(struct tfs_statfs* st);
+
+/* Grows the mounted disk to ‘nBytes’ (rounded down to a multiple of
+BLOCKSIZE, at most 255 blocks) without unmounting it. The new blocks are
+free. A mounted disk cannot shrink, see tfs_resizeImage. */
+int tfs_resize(int nBytes);
+
+/* Grows or shrinks the unmounted disk image ‘filename’ to ‘nBytes’.
+Blocks in use past the new end are first moved into free blocks before
+it, failing if there are not enough. */
+int tfs_resizeImage(char* filename, int nBytes);
+
+/* Moves the blocks of each file in the root directory, open or not,
+into an ascending run of free blocks, so the file can be read in order.
+Files sharing blocks with a snapshot, and files no free run can hold,
+are left alone. Stops once ‘budgetMs’ milliseconds have passed, and the
+next call resumes where it stopped; a budget of 0 or less moves nothing.
+Sets ‘score’, if not NULL, to the percentage of chain links that do not
+point at the next block. Returns 0 after a full pass and 1 if the budget
+ran out first. */
+int tfs_defrag(int budgetMs, int* score);
+
+/* Between tfs_beginBatch and tfs_commitBatch, creates, writes and
+deletes only change blocks in memory, so a directory or bitmap block
+changed by many of them is written once. tfs_commitBatch writes every
+changed block, with the superblock and root directory, in ascending
+block order with one write per run of consecutive blocks. Unmounting
+commits a pending batch. */
+int tfs_beginBatch(void);
+int tfs_commitBatch(void);
+
+/* Queues a request (see tinyFS_async.h) for a pool of worker threads
+and returns its id without waiting for it. Reads and writes at an
+‘offset’ of -1 use and advance the file pointer, any other offset leaves
+it alone. ‘buf’ must stay valid until the request completes. Every call,
+synchronous or not, is serialized, so requests overlap with the caller
+rather than with each other. Requests on the same descriptor run and
+complete in the order they were submitted, those on different
+descriptors in any order. */
+int tfs_submit(int op, fileDescriptor fd, void* buf, int len, int offset, void* userData);
+
+/* Stores up to ‘max’ completed requests in ‘events’, oldest first,
+without waiting. Returns the number stored. */
+int tfs_reap(struct tfs_event* events, int max);
+
+/* Returns a descriptor, for poll() and the like, that is readable while
+completed requests are waiting to be reaped. */
+int tfs_completionFD(void);
+
+/* Points ‘ptr’ at the file's contents at ‘offset’ without copying them,
+and sets ‘len’ to the number of bytes readable there, up to the end of
+the block or file. The block is pinned in the block cache and will not
+change or go away, even if the file is written, until tfs_release is
+called with ‘ptr’. Holes map to zeros. The file position is unchanged.
+Returns ERR_EOF at or past the end of the file. */
+int tfs_readMap(fileDescriptor fd, int offset, const char** ptr, int* len);
+int tfs_release(const char* ptr);
+
+/* Starts recording every API call and every block read and write to the
+trace file ‘filename’ (see tinyFS_trace.h), replayable with tfsReplay.
+Records are kept in a ring of ‘records’ entries (a default size if 0 or
+less) that is written out each time it fills, so tracing costs a clock
+read and a store per event. Only one trace may be recorded at a time. */
+int tfs_traceStart(char* filename, int records);
+
+/* Writes out the buffered records and closes the trace file. Returns an
+error if any records could not be written. */
+int tfs_traceStop(void);
+
 /* creates a directory, name could contain a "/"-delimited path. */
 int tfs_createDir(char* dirName);
 
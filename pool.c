@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define USED -2
+
+/* A chunk is POOL_CHUNK free list links followed by its slots */
+typedef struct {
+	int next[POOL_CHUNK];
+	char data[];
+} chunk;
+
+pool_t pool_new(int size) {
+	pool_t p = {NULL, 0, size, -1};
+	return p;
+}
+
+void pool_free(pool_t* p) {
+	for (int i = 0; i < p->nChunks; i++) {
+		free(p->chunks[i]);
+	}
+	free(p->chunks);
+	p->chunks = NULL;
+	p->nChunks = 0;
+	p->free = -1;
+}
+
+static int grow(pool_t* p) {
+	void** chunks = realloc(p->chunks, (p->nChunks + 1) * sizeof(void*));
+	if (chunks == NULL) {
+		return -1;
+	}
+	p->chunks = chunks;
+	chunk* c = malloc(sizeof(chunk) + POOL_CHUNK * p->size);
+	if (c == NULL) {
+		return -1;
+	}
+	int base = p->nChunks * POOL_CHUNK;
+	for (int i = 0; i < POOL_CHUNK; i++) {
+		c->next[i] = (i+1 < POOL_CHUNK) ? base + i + 1 : -1;
+	}
+	p->chunks[p->nChunks++] = c;
+	p->free = base;
+	return 0;
+}
+
+void* pool_alloc(pool_t* p, int* id) {
+	if (p->free < 0 && grow(p) < 0) {
+		return NULL;
+	}
+	int i = p->free;
+	chunk* c = p->chunks[i / POOL_CHUNK];
+	p->free = c->next[i % POOL_CHUNK];
+	c->next[i % POOL_CHUNK] = USED;
+	void* slot = c->data + (i % POOL_CHUNK) * p->size;
+	memset(slot, 0, p->size);
+	*id = i;
+	return slot;
+}
+
+void* pool_get(pool_t* p, int id) {
+	if (id < 0 || id >= p->nChunks * POOL_CHUNK) {
+		return NULL;
+	}
+	chunk* c = p->chunks[id / POOL_CHUNK];
+	if (c->next[id % POOL_CHUNK] != USED) {
+		return NULL;
+	}
+	return c->data + (id % POOL_CHUNK) * p->size;
+}
+
+void pool_release(pool_t* p, int id) {
+	if (pool_get(p, id) == NULL) {
+		return;
+	}
+	chunk* c = p->chunks[id / POOL_CHUNK];
+	c->next[id % POOL_CHUNK] = p->free;
+	p->free = id;
+}
@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Table of fixed size slots addressed by small integer ids. Slots are
+allocated in chunks that never move, so pointers to them stay valid while
+the table grows, and freed ids are kept on a free list so allocating and
+releasing are O(1). */
+
+#define POOL_CHUNK 64
+
+typedef struct {
+	void** chunks;
+	int nChunks;
+	int size;
+	/* First free id, -1 if every slot of every chunk is in use */
+	int free;
+} pool_t;
+
+pool_t pool_new(int size);
+void pool_free(pool_t* p);
+
+/* Returns a zeroed slot and stores its id in *id, NULL if out of memory */
+void* pool_alloc(pool_t* p, int* id);
+/* Returns the slot with id, NULL if it is not allocated */
+void* pool_get(pool_t* p, int id);
+void pool_release(pool_t* p, int id);
+
+//POOL_H
+#endif
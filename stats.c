@@ -0,0 +1,87 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define NUM_FIELDS (sizeof(struct tfs_stats) / sizeof(unsigned long))
+
+typedef struct node {
+	struct tfs_stats stats;
+	struct node* next;
+} node;
+
+/* Every thread's counters, threads that exit keep theirs in the total */
+node* threads = NULL;
+pthread_mutex_t threadsLock = PTHREAD_MUTEX_INITIALIZER;
+/* Totals at the last reset */
+struct tfs_stats baseline;
+
+__thread node* local = NULL;
+
+struct tfs_stats* stats_local(void) {
+	if (local == NULL) {
+		local = calloc(1, sizeof(node));
+		if (local == NULL) {
+			// Nowhere to count, drop this thread's counts
+			static __thread struct tfs_stats discard;
+			return &discard;
+		}
+		pthread_mutex_lock(&threadsLock);
+		local->next = threads;
+		threads = local;
+		pthread_mutex_unlock(&threadsLock);
+	}
+	return &local->stats;
+}
+
+uint64_t stats_start(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int stats_end(int op, uint64_t start, int ret) {
+	uint64_t ns = stats_start() - start;
+	int bucket = (ns > 1) ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= TFS_STAT_BUCKETS) {
+		bucket = TFS_STAT_BUCKETS - 1;
+	}
+	struct tfs_stats* s = stats_local();
+	s->calls[op]++;
+	s->latency[op][bucket]++;
+	if (ret < 0) {
+		s->errors[op]++;
+	}
+	return ret;
+}
+
+/* Sum every thread's counters into stats, without the baseline */
+static void sum(struct tfs_stats* stats) {
+	unsigned long* dst = (unsigned long*) stats;
+	memset(stats, 0, sizeof(*stats));
+	for (node* n = threads; n; n = n->next) {
+		unsigned long* src = (unsigned long*) &n->stats;
+		for (size_t i = 0; i < NUM_FIELDS; i++) {
+			dst[i] += src[i];
+		}
+	}
+}
+
+void stats_sum(struct tfs_stats* stats) {
+	pthread_mutex_lock(&threadsLock);
+	sum(stats);
+	unsigned long* dst = (unsigned long*) stats;
+	unsigned long* base = (unsigned long*) &baseline;
+	for (size_t i = 0; i < NUM_FIELDS; i++) {
+		dst[i] -= base[i];
+	}
+	pthread_mutex_unlock(&threadsLock);
+}
+
+void stats_reset(void) {
+	pthread_mutex_lock(&threadsLock);
+	sum(&baseline);
+	pthread_mutex_unlock(&threadsLock);
+}
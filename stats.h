@@ -0,0 +1,24 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "tinyFS_stats.h"
+
+/* Counters are kept per thread so updating them needs no locking or
+atomics, and summed when they are read. */
+
+/* This thread's counters */
+struct tfs_stats* stats_local(void);
+
+#define stats_add(field, n) (stats_local()->field += (n))
+
+uint64_t stats_start(void);
+/* Count a call to op that began at start and returned ret, returns ret */
+int stats_end(int op, uint64_t start, int ret);
+
+void stats_sum(struct tfs_stats* stats);
+void stats_reset(void);
+
+//STATS_H
+#endif
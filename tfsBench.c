@@ -0,0 +1,291 @@
+/* TinyFS benchmark suite
+ *  Times the libTinyFS API across disk sizes, file sizes and file counts
+ *  and prints ops/sec and latency percentiles as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tinyFS.h"
+#include "libTinyFS.h"
+#include "tinyFS_layout.h"
+#include "tinyFS_errno.h"
+
+#define BENCH_DISK_NAME "tfsBenchDisk"
+#define DEFAULT_ITERATIONS 50
+#define MAX_SAMPLES 65536
+
+/* Entries that fit in the root directory's inode */
+#define MAX_DIR_ENTRIES (INODE_DATA_SIZE / ENTRY_SIZE)
+
+int diskSizes[] = {DEFAULT_DISK_SIZE, 32768, 65280};
+int fileSizes[] = {100, 1000, 4000, 16000};
+int fileCounts[] = {1, 8, MAX_DIR_ENTRIES};
+
+#define LEN(a) ((int) (sizeof(a) / sizeof((a)[0])))
+
+typedef struct {
+	double samples[MAX_SAMPLES];
+	int n;
+	double total;
+} Timer;
+
+Timer timer;
+FILE* out;
+int nResults = 0;
+int iterations = DEFAULT_ITERATIONS;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void timerReset(void) {
+	timer.n = 0;
+	timer.total = 0;
+}
+
+static void timerAdd(double start) {
+	double ns = now() - start;
+	timer.total += ns;
+	if (timer.n < MAX_SAMPLES) {
+		timer.samples[timer.n++] = ns;
+	}
+}
+
+static int cmpDouble(const void* a, const void* b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(double p) {
+	int i = (int) (p * (timer.n - 1) + 0.5);
+	return timer.samples[i];
+}
+
+/* Print the samples collected since the last timerReset as one result */
+static void report(const char* name, int diskSize, int fileSize, int nFiles) {
+	if (timer.n == 0) {
+		return;
+	}
+	qsort(timer.samples, timer.n, sizeof(double), cmpDouble);
+	fprintf(out, "%s\n    {\"name\": \"%s\", \"disk_size\": %d, \"file_size\": %d, \"files\": %d, "
+			"\"ops\": %d, \"ops_per_sec\": %.1f, \"latency_ns\": {\"min\": %.0f, \"p50\": %.0f, "
+			"\"p90\": %.0f, \"p99\": %.0f, \"max\": %.0f}}",
+			nResults ? "," : "", name, diskSize, fileSize, nFiles,
+			timer.n, timer.n / (timer.total / 1e9), timer.samples[0], percentile(0.5),
+			percentile(0.9), percentile(0.99), timer.samples[timer.n-1]);
+	nResults++;
+}
+
+static int blocksFor(int fileSize) {
+	if (fileSize <= INODE_DATA_SIZE) {
+		return 1;
+	}
+	return 1 + (fileSize - INODE_DATA_SIZE + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE;
+}
+
+static int fits(int diskSize, int fileSize, int nFiles) {
+	return nFiles * blocksFor(fileSize) + 2 <= diskSize / BLOCKSIZE;
+}
+
+static void fileName(char* name, int i) {
+	sprintf(name, "f%d", i);
+}
+
+static int freshDisk(int diskSize) {
+	int err = tfs_mkfs(BENCH_DISK_NAME, diskSize);
+	if (err < 0) {
+		fprintf(stderr, "tfs_mkfs failed (%d)\n", err);
+		return err;
+	}
+	err = tfs_mount(BENCH_DISK_NAME);
+	if (err < 0) {
+		fprintf(stderr, "tfs_mount failed (%d)\n", err);
+	}
+	return err;
+}
+
+static void benchFormat(int diskSize) {
+	double start;
+	timerReset();
+	for (int i = 0; i < iterations; i++) {
+		start = now();
+		if (tfs_mkfs(BENCH_DISK_NAME, diskSize) < 0) {
+			return;
+		}
+		timerAdd(start);
+	}
+	report("mkfs", diskSize, 0, 0);
+	timerReset();
+	for (int i = 0; i < iterations; i++) {
+		start = now();
+		if (tfs_mount(BENCH_DISK_NAME) < 0) {
+			return;
+		}
+		timerAdd(start);
+		tfs_unmount();
+	}
+	report("mount", diskSize, 0, 0);
+}
+
+static void benchFiles(int diskSize, int fileSize, int nFiles, char* content, char* buffer) {
+	fileDescriptor fds[MAX_DIR_ENTRIES];
+	struct iovec iov = {buffer, fileSize};
+	const char* ptr;
+	char name[16], c;
+	double start;
+	int i, j, it, off, len;
+	if (freshDisk(diskSize) < 0) {
+		return;
+	}
+	timerReset();
+	for (i = 0; i < nFiles; i++) {
+		fileName(name, i);
+		start = now();
+		fds[i] = tfs_openFile(name);
+		timerAdd(start);
+		if (fds[i] < 0) {
+			fprintf(stderr, "tfs_openFile failed (%d)\n", fds[i]);
+			tfs_unmount();
+			return;
+		}
+	}
+	report("create", diskSize, fileSize, nFiles);
+	timerReset();
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < nFiles; i++) {
+			start = now();
+			int err = tfs_writeFile(fds[i], content, fileSize);
+			timerAdd(start);
+			if (err < 0) {
+				fprintf(stderr, "tfs_writeFile failed (%d)\n", err);
+				tfs_unmount();
+				return;
+			}
+		}
+	}
+	report("write_file", diskSize, fileSize, nFiles);
+	timerReset();
+	for (i = 0; i < nFiles; i++) {
+		tfs_closeFile(fds[i]);
+	}
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < nFiles; i++) {
+			fileName(name, i);
+			start = now();
+			fds[i] = tfs_openFile(name);
+			timerAdd(start);
+			if (it < iterations-1) {
+				tfs_closeFile(fds[i]);
+			}
+		}
+	}
+	report("open", diskSize, fileSize, nFiles);
+	timerReset();
+	for (i = 0; i < nFiles; i++) {
+		tfs_seek(fds[i], 0);
+		for (j = 0; j < fileSize; j++) {
+			start = now();
+			tfs_readByte(fds[i], &c);
+			timerAdd(start);
+		}
+	}
+	report("read_byte", diskSize, fileSize, nFiles);
+	timerReset();
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < nFiles; i++) {
+			start = now();
+			tfs_seek(fds[i], 0);
+			tfs_readv(fds[i], &iov, 1);
+			timerAdd(start);
+		}
+	}
+	report("read_file", diskSize, fileSize, nFiles);
+	timerReset();
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < nFiles; i++) {
+			start = now();
+			for (off = 0; tfs_readMap(fds[i], off, &ptr, &len) == 0; off += len) {
+				tfs_release(ptr);
+			}
+			timerAdd(start);
+		}
+	}
+	report("read_map", diskSize, fileSize, nFiles);
+	timerReset();
+	srand(fileSize ^ nFiles);
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < nFiles; i++) {
+			off = rand() % fileSize;
+			start = now();
+			tfs_seek(fds[i], off);
+			timerAdd(start);
+		}
+	}
+	report("seek", diskSize, fileSize, nFiles);
+	timerReset();
+	for (i = 0; i < nFiles; i++) {
+		start = now();
+		tfs_deleteFile(fds[i]);
+		timerAdd(start);
+	}
+	report("delete", diskSize, fileSize, nFiles);
+	tfs_unmount();
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	out = stdout;
+	while ((opt = getopt(argc, argv, "n:o:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			case 'o':
+				out = fopen(optarg, "w");
+				if (out == NULL) {
+					perror("fopen");
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n iterations] [-o output.json]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (iterations <= 0) {
+		iterations = 1;
+	}
+	int maxSize = fileSizes[LEN(fileSizes)-1];
+	char* content = malloc(maxSize);
+	char* buffer = malloc(maxSize);
+	for (int i = 0; i < maxSize; i++) {
+		content[i] = 'a' + (i % 26);
+	}
+
+	fprintf(out, "{\n  \"blocksize\": %d,\n  \"iterations\": %d,\n  \"results\": [", BLOCKSIZE, iterations);
+	for (int d = 0; d < LEN(diskSizes); d++) {
+		benchFormat(diskSizes[d]);
+		for (int s = 0; s < LEN(fileSizes); s++) {
+			for (int f = 0; f < LEN(fileCounts); f++) {
+				if (fits(diskSizes[d], fileSizes[s], fileCounts[f])) {
+					benchFiles(diskSizes[d], fileSizes[s], fileCounts[f], content, buffer);
+				}
+			}
+		}
+	}
+	fprintf(out, "\n  ]\n}\n");
+
+	free(content);
+	free(buffer);
+	unlink(BENCH_DISK_NAME);
+	if (out != stdout) {
+		fclose(out);
+	}
+	return 0;
+}
@@ -0,0 +1,329 @@
+/* TinyFS trace replay
+ *  Re-executes the API calls of a trace recorded with tfs_traceStart
+ *  against a fresh disk image and reports throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tinyFS.h"
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+
+#define REPLAY_DISK_NAME "tfsReplayDisk"
+#define CHUNK 1024
+
+char* diskName = REPLAY_DISK_NAME;
+int diskSize = DEFAULT_DISK_SIZE;
+int keepDisk = 0;
+int timed = 0;
+int mounted = 0;
+
+/* Replayed file descriptor for each traced one */
+fileDescriptor* fds = NULL;
+int nFDs = 0;
+
+char* content = NULL;
+int contentSize = 0;
+char* scratch = NULL;
+int scratchSize = 0;
+
+unsigned long replayed = 0, skipped = 0, diverged = 0;
+unsigned long tracedReads = 0, tracedWrites = 0;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t ns) {
+	uint64_t t = now();
+	if (ns <= t) {
+		return;
+	}
+	struct timespec ts = {(ns - t) / 1000000000, (ns - t) % 1000000000};
+	nanosleep(&ts, NULL);
+}
+
+static fileDescriptor mapFD(int fd) {
+	return (fd >= 0 && fd < nFDs) ? fds[fd] : -1;
+}
+
+static int setFD(int fd, fileDescriptor replayFD) {
+	if (fd >= nFDs) {
+		int n = nFDs ? nFDs : 16;
+		while (n <= fd) {
+			n *= 2;
+		}
+		fileDescriptor* tmp = realloc(fds, n * sizeof(*fds));
+		if (tmp == NULL) {
+			return -1;
+		}
+		for (int i = nFDs; i < n; i++) {
+			tmp[i] = -1;
+		}
+		fds = tmp;
+		nFDs = n;
+	}
+	fds[fd] = replayFD;
+	return 0;
+}
+
+/* Writes of the traced size, the trace holds no file contents */
+static char* getContent(int size) {
+	if (size > contentSize) {
+		char* tmp = realloc(content, size);
+		if (tmp == NULL) {
+			return NULL;
+		}
+		for (int i = contentSize; i < size; i++) {
+			tmp[i] = 'a' + (i % 26);
+		}
+		content = tmp;
+		contentSize = size;
+	}
+	return content;
+}
+
+/* Buffer that reads are made into */
+static char* getScratch(int size) {
+	if (size > scratchSize) {
+		char* tmp = realloc(scratch, size);
+		if (tmp == NULL) {
+			return NULL;
+		}
+		scratch = tmp;
+		scratchSize = size;
+	}
+	return scratch;
+}
+
+static int freshDisk(int size) {
+	if (mounted) {
+		tfs_unmount();
+		mounted = 0;
+	}
+	int err = tfs_mkfs(diskName, size);
+	if (err < 0) {
+		fprintf(stderr, "tfs_mkfs failed (%d)\n", err);
+		return err;
+	}
+	if ((err = tfs_mount(diskName)) < 0) {
+		fprintf(stderr, "tfs_mount failed (%d)\n", err);
+		return err;
+	}
+	mounted = 1;
+	return 0;
+}
+
+/* Re-execute one traced call, returns what it returned now */
+static int replay(struct tfs_trace_record* r) {
+	char name[16], c;
+	struct iovec iov;
+	struct tfs_stat st;
+	struct tfs_statfs sfs;
+	int err;
+	switch (r->op) {
+		case TFS_STAT_MKFS:
+			if ((err = freshDisk(r->size)) < 0) {
+				return err;
+			}
+			tfs_unmount();
+			mounted = 0;
+			return 0;
+		case TFS_STAT_MOUNT:
+			if (mounted) {
+				return 0;
+			}
+			if ((err = tfs_mount(diskName)) == 0) {
+				mounted = 1;
+			}
+			return err;
+		case TFS_STAT_UNMOUNT:
+			mounted = 0;
+			return tfs_unmount();
+		case TFS_STAT_OPEN:
+			// Files are told apart by the inode they were opened at
+			sprintf(name, "i%d", r->bNum);
+			err = tfs_openFile(name);
+			if (err >= 0 && setFD(r->ret, err) < 0) {
+				tfs_closeFile(err);
+				return ERR_NOMEMORY;
+			}
+			return err;
+		case TFS_STAT_CLONE:
+			sprintf(name, "i%d", r->bNum);
+			err = tfs_clone(mapFD(r->fd), name);
+			if (err >= 0 && setFD(r->ret, err) < 0) {
+				tfs_closeFile(err);
+				return ERR_NOMEMORY;
+			}
+			return err;
+		case TFS_STAT_STAT:
+			sprintf(name, "i%d", r->bNum);
+			return tfs_stat(name, &st);
+		case TFS_STAT_CLOSE:
+			err = tfs_closeFile(mapFD(r->fd));
+			setFD(r->fd, -1);
+			return err;
+		case TFS_STAT_WRITE_FILE:
+			return tfs_writeFile(mapFD(r->fd), getContent(r->size), r->size);
+		case TFS_STAT_WRITE:
+			return tfs_write(mapFD(r->fd), getContent(r->size), r->size);
+		case TFS_STAT_TRUNCATE:
+			return tfs_truncate(mapFD(r->fd), r->size);
+		case TFS_STAT_DELETE:
+			err = tfs_deleteFile(mapFD(r->fd));
+			setFD(r->fd, -1);
+			return err;
+		case TFS_STAT_READ_BYTE:
+			return tfs_readByte(mapFD(r->fd), &c);
+		case TFS_STAT_SEEK:
+			return tfs_seek(mapFD(r->fd), r->size);
+		case TFS_STAT_WRITEV:
+			iov.iov_base = getContent(r->size);
+			iov.iov_len = r->size;
+			return tfs_writev(mapFD(r->fd), &iov, 1);
+		case TFS_STAT_READV:
+			iov.iov_base = getScratch(r->size);
+			iov.iov_len = r->size;
+			return tfs_readv(mapFD(r->fd), &iov, 1);
+		case TFS_STAT_READ_MAP: {
+			const char* ptr;
+			int len;
+			if ((err = tfs_readMap(mapFD(r->fd), r->size, &ptr, &len)) == 0) {
+				tfs_release(ptr);
+			}
+			return err;
+		}
+		case TFS_STAT_FALLOCATE:
+			return tfs_fallocate(mapFD(r->fd), r->size);
+		case TFS_STAT_RESERVE:
+			return tfs_reserve(mapFD(r->fd), r->size);
+		case TFS_STAT_STATFS:
+			return tfs_statfs(&sfs);
+		case TFS_STAT_DEFRAG:
+			return tfs_defrag(r->size, NULL);
+		case TFS_STAT_RESIZE:
+			return tfs_resize(r->size);
+		case TFS_STAT_BATCH_BEGIN:
+			return tfs_beginBatch();
+		case TFS_STAT_BATCH_COMMIT:
+			return tfs_commitBatch();
+		default:
+			return 1;
+	}
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "td:s:")) != -1) {
+		switch (opt) {
+			case 't':
+				timed = 1;
+				break;
+			case 'd':
+				diskName = optarg;
+				keepDisk = 1;
+				break;
+			case 's':
+				diskSize = atoi(optarg);
+				break;
+			default:
+				optind = argc;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-t] [-d disk] [-s diskSize] trace\n", argv[0]);
+		return 1;
+	}
+	FILE* in = fopen(argv[optind], "rb");
+	if (in == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	struct tfs_trace_header hdr;
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, TFS_TRACE_MAGIC, 4) != 0
+			|| hdr.version != TFS_TRACE_VERSION || hdr.recordSize != sizeof(struct tfs_trace_record)) {
+		fprintf(stderr, "%s: not a TinyFS trace\n", argv[optind]);
+		fclose(in);
+		return 1;
+	}
+
+	// Traces that start after mkfs run against a fresh disk of diskSize
+	if (freshDisk(diskSize) < 0) {
+		fclose(in);
+		return 1;
+	}
+	tfs_resetStats();
+
+	struct tfs_trace_record* recs = malloc(CHUNK * sizeof(*recs));
+	uint64_t first = 0, start = now();
+	unsigned long nRecs = 0;
+	size_t n;
+	while ((n = fread(recs, sizeof(*recs), CHUNK, in)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			struct tfs_trace_record* r = &recs[i];
+			if (nRecs++ == 0) {
+				first = r->ns;
+			}
+			if (r->op == TFS_TRACE_READ_BLOCK) {
+				tracedReads++;
+				continue;
+			} else if (r->op == TFS_TRACE_WRITE_BLOCK) {
+				tracedWrites++;
+				continue;
+			}
+			// Calls that failed in the trace are replayed too, except opens,
+			// clones and stats of files we know nothing about. Snapshots and
+			// images are named and the trace holds no names, and directory
+			// streams are not told apart, so those are not replayed.
+			if (r->op == TFS_STAT_SNAPSHOT || r->op == TFS_STAT_OPEN_SNAPSHOT
+					|| r->op == TFS_STAT_DELETE_SNAPSHOT || r->op == TFS_STAT_RESIZE_IMAGE
+					|| r->op == TFS_STAT_OPEN_DIR || r->op == TFS_STAT_READ_DIR
+					|| r->op >= TFS_STAT_NUM_OPS
+					|| ((r->op == TFS_STAT_OPEN || r->op == TFS_STAT_CLONE
+						|| r->op == TFS_STAT_STAT) && r->bNum < 0)) {
+				skipped++;
+				continue;
+			}
+			if (timed) {
+				sleepUntil(start + (r->ns - first));
+			}
+			int ret = replay(r);
+			replayed++;
+			if ((ret < 0) != (r->ret < 0)) {
+				diverged++;
+			}
+		}
+	}
+	double elapsed = (now() - start) / 1e9;
+	fclose(in);
+	free(recs);
+
+	struct tfs_stats stats;
+	tfs_stats(&stats);
+	if (mounted) {
+		tfs_unmount();
+	}
+	printf("records:       %lu\n", nRecs);
+	printf("replayed:      %lu calls (%lu skipped, %lu diverged)\n", replayed, skipped, diverged);
+	printf("elapsed:       %.6f s\n", elapsed);
+	printf("throughput:    %.1f ops/s, %.1f KiB/s written\n",
+			elapsed > 0 ? replayed / elapsed : 0.0,
+			elapsed > 0 ? stats.bytesWritten / 1024.0 / elapsed : 0.0);
+	printf("block reads:   %lu (traced %lu)\n", stats.blockReads, tracedReads);
+	printf("block writes:  %lu (traced %lu)\n", stats.blockWrites, tracedWrites);
+
+	free(fds);
+	free(content);
+	free(scratch);
+	if (!keepDisk) {
+		unlink(diskName);
+	}
+	return diverged ? 2 : 0;
+}
@@ -2,14 +2,34 @@
  *  * Foaad Khosmood, Cal Poly / modified Winter 2014
  *   */
 
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "tinyFS.h"
+#include "tinyFS_layout.h"
 #include "libTinyFS.h"
 #include "tinyFS_errno.h"
 
+/* number of checks that did not hold */
+static int failures = 0;
+
+/* report a check that does not hold, and keep going */
+#define CHECK(cond) \
+  do \
+    { \
+      if (!(cond)) \
+	{ \
+	  printf ("FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+	  failures++; \
+	} \
+    } \
+  while (0)
+
 /* simple helper function to fill Buffer with as many inPhrase strings as possible before reaching size */
 int
 fillBufferWithPhrase (char *inPhrase, char *Buffer, int size)
@@ -28,6 +48,1192 @@ fillBufferWithPhrase (char *inPhrase, char *Buffer, int size)
   return 0;
 }
 
+/* the disk every group of checks is run on */
+#define CHECK_DISK "checkDisk"
+
+/* unmount whatever is mounted, then make and mount a new disk of nBytes, so every group of checks starts from an empty file system */
+int
+freshDisk (int nBytes)
+{
+  tfs_unmount ();
+  if (tfs_mkfs (CHECK_DISK, nBytes) < 0 || tfs_mount (CHECK_DISK) < 0)
+    {
+      printf ("FAILED: cannot make a disk of %d bytes\n", nBytes);
+      failures++;
+      return -1;
+    }
+  return 0;
+}
+
+/* fill Buffer with size bytes that differ from block to block, starting from seed */
+void
+fillBufferWithPattern (int seed, char *Buffer, int size)
+{
+  int i;
+  for (i = 0; i < size; i++)
+    Buffer[i] = 'a' + (seed + i / 7) % 26;
+}
+
+/* returns 1 if the file open as fd reads back exactly the size bytes of Buffer */
+int
+sameContent (fileDescriptor fd, char *Buffer, int size)
+{
+  char c;
+  int i;
+  if (tfs_seek (fd, 0) < 0)
+    return 0;
+  for (i = 0; i < size; i++)
+    if (tfs_readByte (fd, &c) < 0 || c != Buffer[i])
+      return 0;
+  return tfs_readByte (fd, &c) < 0;
+}
+
+/* returns the size of the largest file there is room for, found by writing one and deleting it again */
+int
+room (void)
+{
+  static char m[256 * BLOCKSIZE];
+  int mid, lo = 0, hi = sizeof (m);
+  fileDescriptor fd = tfs_openFile ("room");
+  if (fd < 0)
+    return 0;
+  fillBufferWithPattern (13, m, sizeof (m));
+  while (lo < hi)
+    {
+      mid = (lo + hi + 1) / 2;
+      if (tfs_writeFile (fd, m, mid) == 0)
+	lo = mid;
+      else
+	hi = mid - 1;
+    }
+  tfs_deleteFile (fd);
+  return lo;
+}
+
+/* write a file that leaves room for about leave more blocks */
+void
+fillDisk (int leave)
+{
+  static char m[256 * BLOCKSIZE];
+  int size = room () - leave * BLOCKSIZE;
+  fileDescriptor fd = tfs_openFile ("fill");
+  fillBufferWithPattern (17, m, sizeof (m));
+  if (fd >= 0 && size > 0)
+    tfs_writeFile (fd, m, size);
+}
+
+/* returns the size tfs_stat reports for name, or the error */
+int
+statSize (char *name)
+{
+  struct tfs_stat st;
+  int err = tfs_stat (name, &st);
+  return (err < 0) ? err : st.size;
+}
+
+
+/* Identical blocks are shared, and a write that does not fit leaves the old content alone */
+void
+checkDedup (void)
+{
+  char a[2500], b[2500];
+  int before;
+  fileDescriptor aFD, bFD, sFD;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  CHECK (tfs_dedup (1) == 0);
+  fillBufferWithPattern (0, a, sizeof (a));
+  aFD = tfs_openFile ("a");
+  CHECK (tfs_writeFile (aFD, a, sizeof (a)) == 0);
+  before = room ();
+  bFD = tfs_openFile ("b");
+  CHECK (tfs_writeFile (bFD, a, sizeof (a)) == 0);
+  CHECK (before - room () <= BLOCKSIZE);	/* only b's inode */
+
+  /* writing a shared block copies it */
+  memcpy (b, a, sizeof (b));
+  b[1000] = '!';
+  CHECK (tfs_writeFile (bFD, b, sizeof (b)) == 0);
+  CHECK (sameContent (bFD, b, sizeof (b)));
+  CHECK (sameContent (aFD, a, sizeof (a)));
+
+  /* a's blocks are all shared with b, so giving them up frees nothing */
+  CHECK (tfs_writeFile (bFD, a, sizeof (a)) == 0);
+  fillDisk (3);
+  fillBufferWithPattern (5, b, sizeof (b));
+  CHECK (tfs_writeFile (aFD, b, sizeof (b)) == ERR_NOMEMORY);
+  CHECK (sameContent (aFD, a, sizeof (a)));
+  CHECK (sameContent (bFD, a, sizeof (a)));
+
+  /* with b gone they are given up to make room */
+  CHECK (tfs_deleteFile (bFD) == 0);
+  CHECK (sameContent (aFD, a, sizeof (a)));
+  CHECK (tfs_writeFile (aFD, b, sizeof (b)) == 0);
+  CHECK (sameContent (aFD, b, sizeof (b)));
+
+  /* the same goes for blocks shared with a snapshot */
+  CHECK (tfs_snapshot ("snap") == 0);
+  fillBufferWithPattern (9, a, sizeof (a));
+  CHECK (tfs_writeFile (aFD, a, sizeof (a)) == ERR_NOMEMORY);
+  CHECK (sameContent (aFD, b, sizeof (b)));
+  sFD = tfs_openSnapshot ("snap", "a");
+  CHECK (sameContent (sFD, b, sizeof (b)));
+  CHECK (tfs_deleteSnapshot ("snap") == 0);
+  CHECK (tfs_writeFile (aFD, a, sizeof (a)) == 0);
+  CHECK (sameContent (aFD, a, sizeof (a)));
+  tfs_unmount ();
+}
+
+/* A snapshot keeps what files held when it was taken, and gives its blocks back when deleted */
+void
+checkSnapshots (void)
+{
+  char a[1500], b[1500];
+  int empty;
+  fileDescriptor aFD, sFD;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  empty = room ();
+  fillBufferWithPattern (0, a, sizeof (a));
+  fillBufferWithPattern (9, b, sizeof (b));
+  aFD = tfs_openFile ("a");
+  CHECK (tfs_writeFile (aFD, a, sizeof (a)) == 0);
+  CHECK (tfs_snapshot ("snap") == 0);
+  CHECK (tfs_snapshot ("snap") < 0);
+  CHECK (tfs_writeFile (aFD, b, 700) == 0);
+  CHECK (sameContent (aFD, b, 700));
+
+  sFD = tfs_openSnapshot ("snap", "a");
+  CHECK (sameContent (sFD, a, sizeof (a)));
+  CHECK (tfs_writeFile (sFD, b, 10) < 0);	/* read only */
+  CHECK (tfs_openSnapshot ("snap", "b") < 0);
+  CHECK (tfs_openSnapshot ("nosnap", "a") < 0);
+
+  /* deleting the live file leaves the snapshot's copy */
+  CHECK (tfs_deleteFile (aFD) == 0);
+  CHECK (sameContent (sFD, a, sizeof (a)));
+
+  CHECK (tfs_deleteSnapshot ("snap") == 0);
+  CHECK (tfs_readByte (sFD, a) < 0);	/* closed with the snapshot */
+  CHECK (tfs_deleteSnapshot ("snap") < 0);
+  CHECK (room () == empty);
+  tfs_unmount ();
+}
+
+/* Writing past the end leaves a hole that reads as zeros and takes no blocks */
+void
+checkSparse (void)
+{
+  static char m[12000];
+  int before;
+  fileDescriptor fd;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  memset (m, 0, sizeof (m));
+  fd = tfs_openFile ("sparse");
+  before = room ();
+  CHECK (tfs_seek (fd, 5000) == 0);
+  memcpy (m + 5000, "0123456789", 10);
+  CHECK (tfs_write (fd, m + 5000, 10) == 0);
+  CHECK (sameContent (fd, m, 5010));
+  CHECK (before - room () <= BLOCKSIZE);	/* one extent */
+
+  /* growing adds a hole, shrinking frees the blocks past the end */
+  CHECK (tfs_truncate (fd, sizeof (m)) == 0);
+  CHECK (sameContent (fd, m, sizeof (m)));
+  CHECK (before - room () <= BLOCKSIZE);
+  CHECK (tfs_seek (fd, 300) == 0);
+  fillBufferWithPattern (2, m + 300, 600);
+  CHECK (tfs_write (fd, m + 300, 600) == 0);
+  CHECK (sameContent (fd, m, sizeof (m)));
+  CHECK (tfs_truncate (fd, 400) == 0);
+  CHECK (sameContent (fd, m, 400));
+  CHECK (before - room () <= BLOCKSIZE);
+  CHECK (tfs_truncate (fd, -1) == ERR_INVALID);
+  tfs_unmount ();
+}
+
+/* seek twice on the descriptor passed in, from another thread */
+void *
+seekTwice (void *arg)
+{
+  fileDescriptor fd = *(fileDescriptor *) arg;
+  tfs_seek (fd, 0);
+  tfs_seek (fd, 0);
+  return NULL;
+}
+
+/* Every call is counted with its errors, latency and the bytes it moved, whichever thread made it */
+void
+checkStats (void)
+{
+  char m[1000], c;
+  struct tfs_stats st;
+  struct tfs_statfs sfs;
+  struct tfs_stat sb;
+  struct tfs_dirent ent;
+  tfsDir *dir;
+  unsigned long n;
+  fileDescriptor fd;
+  pthread_t t;
+  int i;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  fillBufferWithPattern (0, m, sizeof (m));
+  CHECK (tfs_resetStats () == 0);
+  fd = tfs_openFile ("a");
+  CHECK (tfs_writeFile (fd, m, sizeof (m)) == 0);
+  CHECK (tfs_seek (fd, sizeof (m) - 2) == 0);
+  CHECK (tfs_readByte (fd, &c) == 0);
+  CHECK (tfs_readByte (fd, &c) == 0);
+  CHECK (tfs_readByte (fd, &c) < 0);
+  CHECK (pthread_create (&t, NULL, seekTwice, &fd) == 0);
+  pthread_join (t, NULL);
+
+  CHECK (tfs_stats (NULL) == ERR_FAULT);
+  CHECK (tfs_stats (&st) == 0);
+  CHECK (st.calls[TFS_STAT_OPEN] == 1 && st.calls[TFS_STAT_WRITE_FILE] == 1);
+  CHECK (st.calls[TFS_STAT_READ_BYTE] == 3 && st.errors[TFS_STAT_READ_BYTE] == 1);
+  CHECK (st.calls[TFS_STAT_SEEK] == 3 && st.errors[TFS_STAT_SEEK] == 0);
+  CHECK (st.bytesWritten == sizeof (m) && st.bytesRead == 2);
+  CHECK (st.blockWrites > 0);
+  for (n = 0, i = 0; i < TFS_STAT_BUCKETS; i++)
+    n += st.latency[TFS_STAT_READ_BYTE][i];
+  CHECK (n == 3);
+
+  /* counting starts over from a reset */
+  CHECK (tfs_resetStats () == 0);
+  CHECK (tfs_readByte (fd, &c) == 0 && c == m[0]);
+  tfs_stats (&st);
+  CHECK (st.calls[TFS_STAT_OPEN] == 0 && st.bytesWritten == 0);
+  CHECK (st.calls[TFS_STAT_READ_BYTE] == 1 && st.bytesRead == 1);
+  CHECK (st.calls[TFS_STAT_SEEK] == 0);
+
+  /* so are the calls that came after the first ones */
+  CHECK (tfs_resetStats () == 0);
+  CHECK (tfs_beginBatch () == 0);
+  CHECK (tfs_fallocate (fd, 2 * sizeof (m)) == 0);
+  CHECK (tfs_commitBatch () == 0);
+  CHECK (tfs_reserve (fd, 2) == 0);
+  CHECK (tfs_clone (fd, "b") >= 0);
+  CHECK (tfs_stat ("b", &sb) == 0 && tfs_stat ("c", &sb) < 0);
+  CHECK (tfs_statfs (&sfs) == 0);
+  CHECK (tfs_defrag (0, NULL) >= 0);
+  CHECK (tfs_resize (DEFAULT_DISK_SIZE + BLOCKSIZE) == 0);
+  CHECK (tfs_openDir ("/", &dir) == 0);
+  while (tfs_readDir (dir, &ent) == 0);
+  tfs_closeDir (dir);
+  tfs_stats (&st);
+  CHECK (st.calls[TFS_STAT_BATCH_BEGIN] == 1 && st.calls[TFS_STAT_BATCH_COMMIT] == 1);
+  CHECK (st.calls[TFS_STAT_FALLOCATE] == 1 && st.calls[TFS_STAT_RESERVE] == 1);
+  CHECK (st.calls[TFS_STAT_CLONE] == 1 && st.calls[TFS_STAT_STATFS] == 1);
+  CHECK (st.calls[TFS_STAT_STAT] == 2 && st.errors[TFS_STAT_STAT] == 1);
+  CHECK (st.calls[TFS_STAT_DEFRAG] == 1 && st.calls[TFS_STAT_RESIZE] == 1);
+  CHECK (st.calls[TFS_STAT_OPEN_DIR] == 1 && st.calls[TFS_STAT_READ_DIR] == 3);
+  CHECK (st.errors[TFS_STAT_READ_DIR] == 1);
+  tfs_unmount ();
+}
+
+/* the trace every group of trace checks records to */
+#define CHECK_TRACE "checkTrace"
+
+/* A trace holds every call and block read and write in order, and replays without diverging */
+void
+checkTrace (void)
+{
+  char m[600], c;
+  int ops[] = { TFS_STAT_OPEN, TFS_STAT_WRITE_FILE, TFS_STAT_SEEK,
+    TFS_STAT_READ_BYTE, TFS_STAT_DELETE, TFS_STAT_READ_BYTE
+  };
+  int nCalls = 0, nBlocks = 0, status;
+  struct tfs_trace_header hdr;
+  struct tfs_trace_record r;
+  struct tfs_statfs sfs;
+  struct tfs_stat st;
+  fileDescriptor fd;
+  FILE *in;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  fillBufferWithPattern (0, m, sizeof (m));
+  CHECK (tfs_traceStop () == ERR_INVALID);
+  CHECK (tfs_traceStart (CHECK_TRACE, 4) == 0);	/* written out every 4 records */
+  CHECK (tfs_traceStart (CHECK_TRACE, 0) == ERR_AGAIN);
+  fd = tfs_openFile ("a");
+  CHECK (tfs_writeFile (fd, m, sizeof (m)) == 0);
+  CHECK (tfs_seek (fd, 10) == 0);
+  CHECK (tfs_readByte (fd, &c) == 0);
+  CHECK (tfs_deleteFile (fd) == 0);
+  CHECK (tfs_readByte (fd, &c) < 0);
+  CHECK (tfs_traceStop () == 0);
+
+  if ((in = fopen (CHECK_TRACE, "rb")) == NULL)
+    {
+      CHECK (in != NULL);
+      return;
+    }
+  CHECK (fread (&hdr, sizeof (hdr), 1, in) == 1);
+  CHECK (memcmp (hdr.magic, TFS_TRACE_MAGIC, 4) == 0);
+  CHECK (hdr.recordSize == sizeof (r));
+  while (fread (&r, sizeof (r), 1, in) == 1)
+    {
+      if (r.op >= TFS_STAT_NUM_OPS)
+	nBlocks++;
+      else if (nCalls < 6)
+	{
+	  CHECK (r.op == ops[nCalls]);
+	  CHECK ((r.ret < 0) == (nCalls == 5));
+	  CHECK (r.op != TFS_STAT_WRITE_FILE || r.size == sizeof (m));
+	  nCalls++;
+	}
+      else
+	nCalls++;
+    }
+  fclose (in);
+  CHECK (nCalls == 6 && nBlocks > 0);
+
+  /* tfsReplay exits with 2 when a replayed call does not fail or succeed as it did */
+  status = system ("./tfsReplay " CHECK_TRACE " > /dev/null");
+  CHECK (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+  /* and so do clones, stats and the calls on the whole disk */
+  CHECK (tfs_traceStart (CHECK_TRACE, 4) == 0);
+  fd = tfs_openFile ("b");
+  CHECK (tfs_beginBatch () == 0);
+  CHECK (tfs_fallocate (fd, sizeof (m)) == 0);
+  CHECK (tfs_commitBatch () == 0);
+  CHECK (tfs_reserve (fd, 2) == 0);
+  CHECK (tfs_stat ("c", &st) < 0);
+  CHECK (tfs_clone (fd, "c") >= 0);
+  CHECK (tfs_stat ("c", &st) == 0 && st.size == sizeof (m));
+  CHECK (tfs_statfs (&sfs) == 0);
+  CHECK (tfs_defrag (0, NULL) >= 0);
+  CHECK (tfs_traceStop () == 0);
+  status = system ("./tfsReplay " CHECK_TRACE " > " CHECK_TRACE ".out");
+  CHECK (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+  if ((in = fopen (CHECK_TRACE ".out", "r")) != NULL)
+    {
+      while (fgets (m, sizeof (m), in) != NULL)
+	if (strncmp (m, "replayed:", 9) == 0)
+	  CHECK (strstr (m, " 9 calls (1 skipped, 0 diverged)") != NULL);
+      fclose (in);
+    }
+  remove (CHECK_TRACE ".out");
+  remove (CHECK_TRACE);
+  tfs_unmount ();
+}
+
+/* Descriptors open on the same file see each other's writes, and fail once it is deleted */
+void
+checkShared (void)
+{
+  char m[3000], c;
+  fileDescriptor fd[100];
+  int i;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  fillBufferWithPattern (0, m, sizeof (m));
+  for (i = 0; i < 100; i++)
+    fd[i] = tfs_openFile ("a");
+  CHECK (fd[99] >= 0 && fd[99] != fd[0]);
+  CHECK (tfs_writeFile (fd[0], m, sizeof (m)) == 0);
+  CHECK (sameContent (fd[99], m, sizeof (m)));
+
+  /* the block map one walked goes stale when the other rewrites the chain */
+  fillBufferWithPattern (4, m, sizeof (m));
+  CHECK (tfs_writeFile (fd[99], m, 2000) == 0);
+  CHECK (sameContent (fd[0], m, 2000));
+  CHECK (tfs_seek (fd[0], 1500) == 0);
+  CHECK (tfs_seek (fd[1], 10) == 0);
+  CHECK (tfs_readByte (fd[0], &c) == 0 && c == m[1500]);
+  CHECK (tfs_readByte (fd[1], &c) == 0 && c == m[10]);
+
+  /* closed ids are handed out again */
+  CHECK (tfs_closeFile (fd[50]) == 0);
+  CHECK (tfs_readByte (fd[50], &c) == ERR_BADF);
+  CHECK (tfs_openFile ("b") == fd[50]);
+  CHECK (tfs_deleteFile (fd[0]) == 0);
+  CHECK (tfs_readByte (fd[1], &c) == ERR_BADF);
+  CHECK (tfs_closeFile (fd[1]) == 0);
+  tfs_unmount ();
+}
+
+/* A mapped block reads the file's contents in place, and stays as it was until released */
+void
+checkReadMap (void)
+{
+  static char m[20000], b[20000];
+  const char *ptr, *hole;
+  char kept[BLOCKSIZE];
+  int i, len, holeLen;
+  fileDescriptor fd;
+
+  if (freshDisk (4 * DEFAULT_DISK_SIZE) < 0)
+    return;
+  fillBufferWithPattern (0, m, sizeof (m));
+  fd = tfs_openFile ("a");
+  CHECK (tfs_writeFile (fd, m, 1000) == 0);
+  CHECK (tfs_readMap (fd, 1000, &ptr, &len) == ERR_EOF);
+  CHECK (tfs_readMap (fd, 600, &ptr, &len) == 0);
+  CHECK (len > 0 && len <= BLOCKSIZE && memcmp (ptr, m + 600, len) == 0);
+  memcpy (kept, ptr, len);
+
+  /* neither rewriting the file nor reading more blocks than the cache holds moves the mapping */
+  fillBufferWithPattern (3, b, sizeof (b));
+  CHECK (tfs_writeFile (fd, b, sizeof (b)) == 0);
+  CHECK (sameContent (fd, b, sizeof (b)));
+  CHECK (memcmp (ptr, kept, len) == 0);
+  CHECK (tfs_deleteFile (fd) == 0);
+  CHECK (memcmp (ptr, kept, len) == 0);
+  CHECK (tfs_release (ptr) == 0);
+  CHECK (tfs_release (ptr) < 0);
+
+  /* holes map to zeros */
+  fd = tfs_openFile ("sparse");
+  CHECK (tfs_seek (fd, 5000) == 0);
+  CHECK (tfs_write (fd, m, 10) == 0);
+  CHECK (tfs_readMap (fd, 3000, &hole, &holeLen) == 0);
+  for (i = 0; i < holeLen; i++)
+    CHECK (hole[i] == 0);
+  CHECK (tfs_readMap (fd, 5000, &ptr, &len) == 0);
+  CHECK (len >= 10 && memcmp (ptr, m, 10) == 0);
+  CHECK (tfs_release (ptr) == 0);
+  tfs_release (hole);
+  tfs_unmount ();
+}
+
+/* Vectored calls move their buffers in order from and to the file position */
+void
+checkVectors (void)
+{
+  char m[1500], r[1600];
+  struct iovec iov[3];
+  fileDescriptor fd;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  fillBufferWithPattern (0, m, sizeof (m));
+  fd = tfs_openFile ("a");
+  iov[0].iov_base = m;
+  iov[0].iov_len = 100;
+  iov[1].iov_base = m + 100;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = m + 100;
+  iov[2].iov_len = sizeof (m) - 100;
+  CHECK (tfs_writev (fd, iov, 3) == sizeof (m));
+  CHECK (sameContent (fd, m, sizeof (m)));
+
+  /* a short read at the end of the file, nothing past it */
+  CHECK (tfs_seek (fd, 50) == 0);
+  iov[0].iov_base = r;
+  iov[0].iov_len = 1000;
+  iov[1].iov_base = r + 1000;
+  iov[1].iov_len = 600;
+  CHECK (tfs_readv (fd, iov, 2) == sizeof (m) - 50);
+  CHECK (memcmp (r, m + 50, sizeof (m) - 50) == 0);
+  CHECK (tfs_readv (fd, iov, 2) == 0);
+  tfs_unmount ();
+}
+
+/* wait up to two seconds for one submitted request to complete and reap it, returns its result */
+int
+reapOne (void)
+{
+  struct pollfd p = { tfs_completionFD (), POLLIN, 0 };
+  struct tfs_event ev;
+  if (poll (&p, 1, 2000) != 1 || tfs_reap (&ev, 1) != 1)
+    return ERR_AGAIN;
+  return ev.res;
+}
+
+/* Submitted requests do what the calls do, and are counted like them */
+void
+checkAsync (void)
+{
+  char m[1100], r[1200];
+  struct tfs_stats st;
+  fileDescriptor fd;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  memset (m, 0, sizeof (m));
+  fillBufferWithPattern (3, m + 100, 1000);
+  memcpy (m, "0123456789", 10);
+  tfs_resetStats ();
+  CHECK (tfs_submit (TFS_OP_OPEN, -1, "async", 0, 0, NULL) >= 0);
+  CHECK ((fd = reapOne ()) >= 0);
+
+  /* a write at an offset leaves the file pointer at 0 for the next one */
+  CHECK (tfs_submit (TFS_OP_WRITE, fd, m + 100, 1000, 100, NULL) >= 0);
+  CHECK (reapOne () == 1000);
+  CHECK (tfs_submit (TFS_OP_WRITE, fd, m, 10, -1, NULL) >= 0);
+  CHECK (reapOne () == 10);
+  CHECK (tfs_submit (TFS_OP_READ, fd, r, sizeof (r), 0, NULL) >= 0);
+  CHECK (reapOne () == sizeof (m));
+  CHECK (memcmp (r, m, sizeof (m)) == 0);
+  CHECK (tfs_submit (TFS_OP_CLOSE, fd, NULL, 0, 0, NULL) >= 0);
+  CHECK (reapOne () == 0);
+  CHECK (tfs_submit (TFS_OP_READ, fd, r, 10, 0, NULL) >= 0);
+  CHECK (reapOne () < 0);
+
+  tfs_stats (&st);
+  CHECK (st.calls[TFS_STAT_OPEN] == 1);
+  CHECK (st.calls[TFS_STAT_WRITEV] == 2);
+  CHECK (st.calls[TFS_STAT_READV] == 2 && st.errors[TFS_STAT_READV] == 1);
+  CHECK (st.calls[TFS_STAT_CLOSE] == 1);
+  CHECK (st.bytesWritten == 1010 && st.bytesRead == sizeof (m));
+  tfs_unmount ();
+}
+
+/* Requests on one descriptor complete in the order they were submitted, even with others in flight */
+void
+checkAsyncOrder (void)
+{
+  char m[2][800];
+  struct pollfd p;
+  struct tfs_event ev[16];
+  fileDescriptor fd[2];
+  int i, j, n, got = 0, last[2] = { -1, -1 };
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  for (i = 0; i < 2; i++)
+    {
+      fillBufferWithPattern (i + 30, m[i], sizeof (m[i]));
+      fd[i] = tfs_openFile (i ? "ob" : "oa");
+    }
+  for (j = 0; j < 40; j++)
+    for (i = 0; i < 2; i++)
+      CHECK (tfs_submit (TFS_OP_WRITE, fd[i], m[i] + j * 20, 20, -1, NULL) >= 0);
+  p.fd = tfs_completionFD ();
+  p.events = POLLIN;
+  while (got < 80 && poll (&p, 1, 2000) == 1)
+    {
+      n = tfs_reap (ev, 16);
+      for (j = 0; j < n; j++)
+	{
+	  i = (ev[j].fd == fd[1]);
+	  CHECK (ev[j].res == 20 && ev[j].id > last[i]);
+	  last[i] = ev[j].id;
+	}
+      got += n;
+    }
+  CHECK (got == 80);
+  CHECK (sameContent (fd[0], m[0], sizeof (m[0])));
+  CHECK (sameContent (fd[1], m[1], sizeof (m[1])));
+  tfs_unmount ();
+}
+
+
+/* Changes made in a batch are only written when it is committed */
+void
+checkBatch (void)
+{
+  char m[600], name[9];
+  struct tfs_stats st;
+  fileDescriptor fd[10];
+  int i;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  CHECK (tfs_commitBatch () < 0);
+  CHECK (tfs_beginBatch () == 0);
+  CHECK (tfs_beginBatch () < 0);
+  tfs_resetStats ();
+  for (i = 0; i < 10; i++)
+    {
+      snprintf (name, sizeof (name), "b%d", i);
+      fd[i] = tfs_openFile (name);
+      fillBufferWithPattern (i, m, sizeof (m));
+      CHECK (tfs_writeFile (fd[i], m, sizeof (m)) == 0);
+    }
+  CHECK (tfs_deleteFile (fd[0]) == 0);
+  CHECK (sameContent (fd[9], m, sizeof (m)));
+  tfs_stats (&st);
+  CHECK (st.blockWrites == 0);
+  CHECK (tfs_commitBatch () == 0);
+  tfs_stats (&st);
+  CHECK (st.blockWrites > 0);
+
+  /* unmounting commits a pending batch, deleted files come back empty */
+  CHECK (tfs_beginBatch () == 0);
+  CHECK (tfs_deleteFile (fd[1]) == 0);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  for (i = 0; i < 10; i++)
+    {
+      snprintf (name, sizeof (name), "b%d", i);
+      fd[i] = tfs_openFile (name);
+      fillBufferWithPattern (i, m, sizeof (m));
+      CHECK (sameContent (fd[i], m, i < 2 ? 0 : sizeof (m)));
+    }
+  tfs_unmount ();
+}
+
+/* A directory stream lists every file once, with what tfs_stat reports for it */
+void
+checkDir (void)
+{
+  char *names[] = { "a", "bb", "ccc" };
+  int sizes[] = { 600, 0, 300 }, seen[3] = { 0, 0, 0 };
+  char m[600];
+  struct tfs_dirent ent;
+  struct tfs_stat st, st2;
+  tfsDir *dir;
+  fileDescriptor fd;
+  int i, n = 0;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  fillBufferWithPattern (7, m, sizeof (m));
+  for (i = 0; i < 3; i++)
+    {
+      fd = tfs_openFile (names[i]);
+      if (sizes[i] > 0)
+        CHECK (tfs_writeFile (fd, m, sizes[i]) == 0);
+    }
+  CHECK (tfs_stat ("/", &st) == 0 && (st.flags & TFS_FLAG_ISDIR));
+  CHECK (tfs_stat ("/ccc", &st) == 0 && st.size == 300);
+  CHECK (tfs_stat ("none", &st) < 0);
+  CHECK (tfs_openDir ("/sub", &dir) < 0);
+
+  /* a file created during the listing does not make the others repeat */
+  CHECK (tfs_openDir ("/", &dir) == 0);
+  while (tfs_readDirPlus (dir, &ent, &st) == 0)
+    {
+      if (n++ == 0)
+        tfs_openFile ("late");
+      for (i = 0; i < 3; i++)
+        if (strcmp (ent.name, names[i]) == 0)
+          {
+            seen[i]++;
+            CHECK (st.size == sizes[i] && st.inode == ent.inode);
+            CHECK (tfs_stat (names[i], &st2) == 0
+                   && st2.inode == st.inode && st2.size == st.size);
+          }
+    }
+  CHECK (tfs_readDir (dir, &ent) == ERR_EOF);
+  CHECK (tfs_closeDir (dir) == 0);
+  CHECK (seen[0] == 1 && seen[1] == 1 && seen[2] == 1);
+  tfs_unmount ();
+}
+
+/* Defragmenting moves a file laid over the holes of deleted ones into one run, without changing it or losing blocks */
+void
+checkDefrag (void)
+{
+  static char m[20 * BLOCKSIZE], s[BLOCKSIZE];
+  char name[9];
+  fileDescriptor fd[10], big;
+  struct tfs_statfs st, st2;
+  int i, before, after, free;
+
+  if (freshDisk (4 * DEFAULT_DISK_SIZE) < 0)
+    return;
+  for (i = 0; i < 10; i++)
+    {
+      snprintf (name, sizeof (name), "s%d", i);
+      fd[i] = tfs_openFile (name);
+      fillBufferWithPattern (i, s, sizeof (s));
+      CHECK (tfs_writeFile (fd[i], s, sizeof (s)) == 0);
+    }
+  for (i = 0; i < 10; i += 2)
+    CHECK (tfs_deleteFile (fd[i]) == 0);
+  big = tfs_openFile ("big");
+  fillBufferWithPattern (23, m, sizeof (m));
+  CHECK (tfs_writeFile (big, m, sizeof (m)) == 0);
+  free = room ();
+  tfs_statfs (&st);
+
+  CHECK (tfs_defrag (0, &before) >= 0);
+  CHECK (before > 0);
+  CHECK (tfs_defrag (1000, &after) == 0);
+  CHECK (after < before);
+  CHECK (room () == free);
+  tfs_statfs (&st2);
+  CHECK (st2.freeBlocks == st.freeBlocks && st2.files == st.files);
+  CHECK (sameContent (big, m, sizeof (m)));
+  for (i = 1; i < 10; i += 2)
+    {
+      fillBufferWithPattern (i, s, sizeof (s));
+      CHECK (sameContent (fd[i], s, sizeof (s)));
+    }
+
+  /* the moved chains are what the disk holds after a remount */
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  tfs_statfs (&st2);
+  CHECK (st2.freeBlocks == st.freeBlocks && st2.files == st.files);
+  big = tfs_openFile ("big");
+  CHECK (sameContent (big, m, sizeof (m)));
+  for (i = 1; i < 10; i += 2)
+    {
+      snprintf (name, sizeof (name), "s%d", i);
+      fd[i] = tfs_openFile (name);
+      fillBufferWithPattern (i, s, sizeof (s));
+      CHECK (sameContent (fd[i], s, sizeof (s)));
+    }
+  tfs_unmount ();
+}
+
+/* A mounted disk can grow, an unmounted one can also shrink down to the blocks in use */
+void
+checkResize (void)
+{
+  char m[5000];
+  fileDescriptor fd;
+  int free, grown;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  free = room ();
+  CHECK (tfs_resize (2 * DEFAULT_DISK_SIZE) == 0);
+  grown = room () - free;
+  CHECK (grown > DEFAULT_DISK_SIZE / 2 && grown <= DEFAULT_DISK_SIZE);
+  CHECK (tfs_resize (DEFAULT_DISK_SIZE) == ERR_TXTBUSY);
+  CHECK (tfs_resize (256 * BLOCKSIZE) == ERR_INVALID);
+
+  /* leave a file's blocks near the end of the disk, so shrinking has to move them */
+  fd = tfs_openFile ("pad");
+  fillBufferWithPattern (0, m, sizeof (m));
+  CHECK (tfs_writeFile (fd, m, 4000) == 0);
+  fd = tfs_openFile ("a");
+  fillBufferWithPattern (4, m, sizeof (m));
+  CHECK (tfs_writeFile (fd, m, sizeof (m)) == 0);
+  CHECK (tfs_deleteFile (tfs_openFile ("pad")) == 0);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_resizeImage (CHECK_DISK, 10 * BLOCKSIZE) == ERR_NOMEMORY);
+  CHECK (tfs_resizeImage (CHECK_DISK, DEFAULT_DISK_SIZE) == 0);
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  CHECK (sameContent (fd = tfs_openFile ("a"), m, sizeof (m)));
+  CHECK (tfs_deleteFile (fd) == 0);
+  CHECK (room () == free);
+  tfs_unmount ();
+}
+
+/* returns the host storage behind the check disk, in 512 byte units */
+long
+diskUsage (void)
+{
+  struct stat sb;
+  return stat (CHECK_DISK, &sb) < 0 ? -1 : (long) sb.st_blocks;
+}
+
+/* With discard on, deleting a file gives its blocks back to the host, and the setting survives a remount */
+void
+checkDiscard (void)
+{
+  static char m[30 * BLOCKSIZE];
+  fileDescriptor fd;
+  long used;
+
+  if (freshDisk (4 * DEFAULT_DISK_SIZE) < 0)
+    return;
+  fillBufferWithPattern (9, m, sizeof (m));
+  fd = tfs_openFile ("a");
+  CHECK (tfs_writeFile (fd, m, sizeof (m)) == 0);
+  CHECK (tfs_writeFile (tfs_openFile ("b"), m, sizeof (m)) == 0);
+  CHECK (tfs_discard (1) == 0);
+  used = diskUsage ();
+  CHECK (tfs_deleteFile (fd) == 0);
+  CHECK (diskUsage () < used);
+
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  fd = tfs_openFile ("b");
+  CHECK (sameContent (fd, m, sizeof (m)));
+  used = diskUsage ();
+  CHECK (tfs_writeFile (fd, m, 100) == 0);
+  CHECK (diskUsage () < used);
+  CHECK (sameContent (fd, m, 100));
+
+  /* in a batch, freed blocks are punched out on commit, unless the batch took them again */
+  CHECK (tfs_writeFile (tfs_openFile ("c"), m, sizeof (m)) == 0);
+  used = diskUsage ();
+  CHECK (tfs_beginBatch () == 0);
+  CHECK (tfs_deleteFile (tfs_openFile ("c")) == 0);
+  CHECK (tfs_writeFile (fd, m, 10 * BLOCKSIZE) == 0);
+  CHECK (diskUsage () == used);
+  CHECK (tfs_commitBatch () == 0);
+  CHECK (diskUsage () < used);
+  CHECK (sameContent (fd, m, 10 * BLOCKSIZE));
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  fd = tfs_openFile ("b");
+  CHECK (sameContent (fd, m, 10 * BLOCKSIZE));
+
+  /* turned off, freed blocks stay where they are */
+  CHECK (tfs_discard (0) == 0);
+  used = diskUsage ();
+  CHECK (tfs_deleteFile (fd) == 0);
+  CHECK (diskUsage () == used);
+  tfs_unmount ();
+}
+
+/* A disk mounted direct holds the same files as one mounted through the page cache */
+void
+checkDirect (void)
+{
+  static char m[20 * BLOCKSIZE], n[3 * BLOCKSIZE];
+  fileDescriptor fd;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  tfs_unmount ();
+  CHECK (tfs_mountFlags (CHECK_DISK, TFS_MOUNT_DIRECT) == ERR_INVALID);
+  if (freshDisk (64 * BLOCKSIZE) < 0)
+    return;
+  fillBufferWithPattern (11, m, sizeof (m));
+  fillBufferWithPattern (12, n, sizeof (n));
+  CHECK (tfs_writeFile (tfs_openFile ("a"), m, sizeof (m)) == 0);
+  tfs_unmount ();
+
+  CHECK (tfs_mountFlags (CHECK_DISK, TFS_MOUNT_DIRECT) == 0);
+  fd = tfs_openFile ("a");
+  CHECK (sameContent (fd, m, sizeof (m)));
+  CHECK (tfs_writeFile (tfs_openFile ("b"), n, sizeof (n)) == 0);
+  CHECK (tfs_writeFile (fd, m, sizeof (m) / 2) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  CHECK (sameContent (tfs_openFile ("a"), m, sizeof (m) / 2));
+  CHECK (sameContent (tfs_openFile ("b"), n, sizeof (n)));
+  tfs_unmount ();
+}
+
+/* the host file RAM disks are saved to and loaded from */
+#define CHECK_IMAGE "checkImage"
+
+/* A RAM disk saved to a file mounts from it, and loads back into another RAM disk */
+void
+checkImage (void)
+{
+  static char m[10 * BLOCKSIZE];
+  fileDescriptor fd;
+
+  tfs_unmount ();
+  fillBufferWithPattern (21, m, sizeof (m));
+  CHECK (tfs_mkfs ("mem:img", DEFAULT_DISK_SIZE) == 0);
+  CHECK (tfs_mount ("mem:img") == 0);
+  CHECK (tfs_writeFile (tfs_openFile ("a"), m, sizeof (m)) == 0);
+  CHECK (tfs_saveImage (CHECK_IMAGE) == 0);
+  CHECK (tfs_writeFile (tfs_openFile ("b"), m, 10) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  /* the RAM disk keeps its files until the process exits */
+  CHECK (tfs_mount ("mem:img") == 0);
+  CHECK (sameContent (tfs_openFile ("b"), m, 10));
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mount (CHECK_IMAGE) == 0);
+  CHECK (sameContent (tfs_openFile ("a"), m, sizeof (m)));
+  CHECK (sameContent (tfs_openFile ("b"), m, 0));
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_loadImage (CHECK_IMAGE, "mem:copy") == 0);
+  CHECK (tfs_mount ("mem:copy") == 0);
+  CHECK (tfs_loadImage (CHECK_IMAGE, "mem:copy") < 0);
+  fd = tfs_openFile ("a");
+  CHECK (sameContent (fd, m, sizeof (m)));
+  CHECK (tfs_writeFile (fd, m + 1, 100) == 0);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mount ("mem:copy") == 0);
+  CHECK (sameContent (tfs_openFile ("a"), m + 1, 100));
+  tfs_unmount ();
+  remove (CHECK_IMAGE);
+}
+
+/* On a disk with an inode table, tfs_stat and listings report what was written, before and after a remount */
+void
+checkInodeTable (void)
+{
+  char m[700], name[9];
+  struct tfs_dirent ent;
+  struct tfs_stat st;
+  tfsDir *dir;
+  int i, n;
+
+  tfs_unmount ();
+  CHECK (tfs_mkfsFlags (CHECK_DISK, DEFAULT_DISK_SIZE, TFS_MKFS_ITABLE) == 0);
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  fillBufferWithPattern (2, m, sizeof (m));
+  for (i = 0; i < 6; i++)
+    {
+      snprintf (name, sizeof (name), "t%d", i);
+      CHECK (tfs_writeFile (tfs_openFile (name), m, 100 * i + 1) == 0);
+    }
+  CHECK (tfs_writeFile (tfs_openFile ("t5"), m, 7) == 0);
+  CHECK (tfs_deleteFile (tfs_openFile ("t0")) == 0);
+
+  for (n = 0; n < 2; n++)
+    {
+      for (i = 1; i < 6; i++)
+        {
+          snprintf (name, sizeof (name), "t%d", i);
+          CHECK (tfs_stat (name, &st) == 0
+                 && st.size == (i == 5 ? 7 : 100 * i + 1));
+        }
+      CHECK (tfs_stat ("t0", &st) < 0);
+      CHECK (tfs_openDir ("/", &dir) == 0);
+      while (tfs_readDirPlus (dir, &ent, &st) == 0)
+        CHECK (strcmp (ent.name, "t5") == 0 ? st.size == 7
+               : st.size == 100 * (ent.name[1] - '0') + 1);
+      tfs_closeDir (dir);
+      CHECK (tfs_unmount () == 0);
+      CHECK (tfs_mount (CHECK_DISK) == 0);
+    }
+  tfs_unmount ();
+}
+
+/* A clone shares the blocks of its source until either is written */
+void
+checkClone (void)
+{
+  char a[2000], b[2000], c[2000];
+  int free, before;
+  fileDescriptor aFD, cFD, sFD;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  free = room ();
+  fillBufferWithPattern (0, a, sizeof (a));
+  fillBufferWithPattern (7, b, sizeof (b));
+  aFD = tfs_openFile ("a");
+  CHECK (tfs_writeFile (aFD, a, sizeof (a)) == 0);
+  before = room ();
+  CHECK ((cFD = tfs_clone (aFD, "c")) >= 0);
+  CHECK (before - room () <= BLOCKSIZE);	/* only the inode */
+  CHECK (sameContent (cFD, a, sizeof (a)));
+  CHECK (tfs_clone (aFD, "c") < 0);
+
+  /* writing either file leaves the other alone */
+  memcpy (c, a, sizeof (c));
+  memcpy (c + 1000, b, 10);
+  CHECK (tfs_seek (cFD, 1000) == 0);
+  CHECK (tfs_write (cFD, b, 10) == 0);
+  CHECK (sameContent (cFD, c, sizeof (c)));
+  CHECK (sameContent (aFD, a, sizeof (a)));
+  CHECK (tfs_writeFile (aFD, b, 300) == 0);
+  CHECK (sameContent (aFD, b, 300));
+  CHECK (sameContent (cFD, c, sizeof (c)));
+  CHECK (tfs_deleteFile (aFD) == 0);
+  CHECK (sameContent (cFD, c, sizeof (c)));
+
+  /* cloning a file out of a snapshot restores it */
+  CHECK (tfs_snapshot ("snap") == 0);
+  CHECK (tfs_deleteFile (cFD) == 0);
+  sFD = tfs_openSnapshot ("snap", "c");
+  CHECK ((cFD = tfs_clone (sFD, "c")) >= 0);
+  CHECK (tfs_deleteSnapshot ("snap") == 0);
+  CHECK (sameContent (cFD, c, sizeof (c)));
+  CHECK (tfs_deleteFile (cFD) == 0);
+  CHECK (room () == free);
+  tfs_unmount ();
+}
+
+
+/* Preallocated blocks read as zeros and later writes within them take no more blocks */
+void
+checkFallocate (void)
+{
+  char m[1000];
+  fileDescriptor aFD, bFD;
+  int free, used;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  memset (m, 0, sizeof (m));
+  bFD = tfs_openFile ("b");
+  free = room ();
+  aFD = tfs_openFile ("a");
+  CHECK (tfs_writeFile (aFD, m, 800) == 0);
+  CHECK (tfs_deleteFile (aFD) == 0);
+  CHECK (tfs_fallocate (bFD, sizeof (m)) == 0);
+  CHECK (statSize ("b") == sizeof (m));
+  CHECK (sameContent (bFD, m, sizeof (m)));
+
+  /* blocks freed before the preallocation are not handed out again */
+  fillBufferWithPattern (1, m, sizeof (m));
+  CHECK (tfs_seek (bFD, 0) == 0);
+  CHECK (tfs_write (bFD, m, sizeof (m)) == 0);
+  aFD = tfs_openFile ("c");
+  CHECK (tfs_writeFile (aFD, m, 600) == 0);
+  CHECK (sameContent (bFD, m, sizeof (m)));
+  CHECK (sameContent (aFD, m, 600));
+  CHECK (tfs_deleteFile (aFD) == 0);
+  used = free - room ();
+  CHECK (used > 3 * BLOCKSIZE && used <= 4 * BLOCKSIZE);	/* 4 extents */
+
+  CHECK (tfs_fallocate (bFD, 100) == 0);
+  CHECK (statSize ("b") == sizeof (m));
+  CHECK (tfs_fallocate (bFD, 60 * BLOCKSIZE) == ERR_NOMEMORY);
+  CHECK (sameContent (bFD, m, sizeof (m)));
+  CHECK (free - room () == used);
+  tfs_unmount ();
+}
+
+/* Rewriting a file shared with a snapshot copies it, and fails untouched when the copy does not fit */
+void
+checkWriteFile (void)
+{
+  char a[2500], b[2500], c[DEFAULT_DISK_SIZE];
+  struct tfs_statfs before, after;
+  fileDescriptor aFD, sFD, cFD;
+  FILE *f;
+  int n;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  fillBufferWithPattern (0, a, sizeof (a));
+  fillBufferWithPattern (5, b, sizeof (b));
+  aFD = tfs_openFile ("a");
+  CHECK (tfs_writeFile (aFD, a, sizeof (a)) == 0);
+  CHECK (tfs_writeFile (aFD, a, -1) == ERR_INVALID);
+  CHECK (tfs_snapshot ("snap") == 0);
+  fillDisk (3);
+  CHECK (tfs_writeFile (aFD, b, 2000) == ERR_NOMEMORY);	/* needs 8 blocks */
+  CHECK (statSize ("a") == sizeof (a));
+  CHECK (sameContent (aFD, a, sizeof (a)));
+  sFD = tfs_openSnapshot ("snap", "a");
+  CHECK (sameContent (sFD, a, sizeof (a)));
+  CHECK (room () <= 3 * BLOCKSIZE);
+
+  /* with the snapshot gone the blocks are rewritten in place */
+  CHECK (tfs_deleteSnapshot ("snap") == 0);
+  CHECK (tfs_writeFile (aFD, b, 2000) == 0);
+  CHECK (sameContent (aFD, b, 2000));
+  CHECK (tfs_writeFile (aFD, b, sizeof (b)) == 0);
+  CHECK (sameContent (aFD, b, sizeof (b)));
+  tfs_unmount ();
+
+  /* a write that runs out of blocks partway gives back those it took */
+  f = fopen (CHECK_DISK, "r+b");
+  CHECK (f != NULL);
+  if (f == NULL)
+    return;
+  fseek (f, SUPER_FREE, SEEK_SET);
+  n = fgetc (f);
+  fseek (f, SUPER_FREE, SEEK_SET);
+  fputc (n + 4, f);		/* four free blocks that are not there */
+  fclose (f);
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  cFD = tfs_openFile ("c");
+  tfs_statfs (&before);
+  n = INODE_DATA_SIZE + (before.freeBlocks - 2) * BLOCK_DATA_SIZE;
+  CHECK (tfs_write (cFD, c, n) == ERR_NOMEMORY);
+  tfs_statfs (&after);
+  CHECK (after.freeBlocks == before.freeBlocks);
+  CHECK (statSize ("c") == 0);
+  tfs_unmount ();
+}
+
+/* The superblock counts follow every change, and reserved blocks are only used by their file */
+void
+checkStatfs (void)
+{
+  char m[2000];
+  struct tfs_statfs empty, st;
+  fileDescriptor aFD, bFD;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  CHECK (tfs_statfs (NULL) == ERR_FAULT);
+  tfs_statfs (&empty);
+  CHECK (empty.blockSize == BLOCKSIZE);
+  CHECK (empty.blocks == DEFAULT_DISK_SIZE / BLOCKSIZE);
+  CHECK (empty.freeBlocks == empty.blocks - 2);	/* superblock and root */
+  CHECK (empty.availBlocks == empty.freeBlocks && empty.files == 0);
+
+  fillBufferWithPattern (0, m, sizeof (m));
+  aFD = tfs_openFile ("a");
+  CHECK (tfs_writeFile (aFD, m, sizeof (m)) == 0);
+  bFD = tfs_openFile ("b");
+  tfs_statfs (&st);
+  CHECK (st.files == 2 && st.freeBlocks == empty.freeBlocks - 9);
+
+  /* a reservation holds blocks back from every other file */
+  CHECK (tfs_reserve (bFD, st.freeBlocks + 1) == ERR_NOMEMORY);
+  CHECK (tfs_reserve (bFD, 8) == 0);
+  tfs_statfs (&st);
+  CHECK (st.availBlocks == st.freeBlocks - 8);
+  fillDisk (0);
+  CHECK (tfs_writeFile (aFD, m, sizeof (m) + 500) == ERR_NOMEMORY);
+  CHECK (tfs_writeFile (bFD, m, sizeof (m)) == 0);
+  CHECK (sameContent (bFD, m, sizeof (m)));
+  tfs_statfs (&st);
+  CHECK (st.availBlocks == 0);
+  CHECK (tfs_reserve (bFD, 0) == 0);
+
+  /* the counts are kept on disk */
+  CHECK (tfs_deleteFile (aFD) == 0);
+  tfs_statfs (&st);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  tfs_statfs (&empty);
+  CHECK (empty.freeBlocks == st.freeBlocks && empty.files == st.files);
+  tfs_unmount ();
+}
+
+/* tfsck finds a chain broken on disk, repairs it with -r, and leaves a disk it can mount */
+void
+checkFsck (void)
+{
+  char m[2000];
+  struct tfs_stat st;
+  FILE *f;
+
+  if (freshDisk (DEFAULT_DISK_SIZE) < 0)
+    return;
+  fillBufferWithPattern (8, m, sizeof (m));
+  CHECK (tfs_writeFile (tfs_openFile ("a"), m, sizeof (m)) == 0);
+  CHECK (tfs_writeFile (tfs_openFile ("b"), m, sizeof (m)) == 0);
+  CHECK (tfs_stat ("a", &st) == 0);
+  CHECK (tfs_unmount () == 0);
+  CHECK (system ("./tfsck " CHECK_DISK " > /dev/null") == 0);
+
+  /* point the inode of a past the end of the disk */
+  f = fopen (CHECK_DISK, "r+b");
+  CHECK (f != NULL);
+  if (f == NULL)
+    return;
+  fseek (f, (long) st.inode * BLOCKSIZE + 2, SEEK_SET);
+  fputc (0xff, f);
+  fclose (f);
+  CHECK (WEXITSTATUS (system ("./tfsck " CHECK_DISK " > /dev/null")) == 4);
+  CHECK (WEXITSTATUS (system ("./tfsck -r " CHECK_DISK " > /dev/null")) == 1);
+  CHECK (system ("./tfsck " CHECK_DISK " > /dev/null") == 0);
+
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  CHECK (sameContent (tfs_openFile ("b"), m, sizeof (m)));
+  tfs_unmount ();
+
+  /* a lost inode table block fails the mount until tfsck drops the table */
+  CHECK (tfs_mkfsFlags (CHECK_DISK, DEFAULT_DISK_SIZE, TFS_MKFS_ITABLE) == 0);
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  CHECK (tfs_writeFile (tfs_openFile ("a"), m, sizeof (m)) == 0);
+  CHECK (tfs_unmount () == 0);
+  f = fopen (CHECK_DISK, "r+b");
+  CHECK (f != NULL);
+  if (f == NULL)
+    return;
+  fseek (f, SUPER_ITABLE, SEEK_SET);
+  fseek (f, (long) fgetc (f) * BLOCKSIZE, SEEK_SET);
+  fputc (BLOCK_FREE, f);
+  fclose (f);
+  CHECK (tfs_mount (CHECK_DISK) == ERR_INVALID);
+  CHECK (WEXITSTATUS (system ("./tfsck -r " CHECK_DISK " > /dev/null")) == 1);
+  CHECK (system ("./tfsck " CHECK_DISK " > /dev/null") == 0);
+  CHECK (tfs_mount (CHECK_DISK) == 0);
+  CHECK (tfs_stat ("a", &st) == 0 && st.size == sizeof (m));
+  CHECK (sameContent (tfs_openFile ("a"), m, sizeof (m)));
+  tfs_unmount ();
+}
+
 /* This program will create 2 files (of sizes 200 and 1000) to be read from or stored in the TinyFS file system. */
 int
 main ()
@@ -158,6 +1364,33 @@ main ()
     perror ("tfs_unmount failed");
 
   printf ("\nend of demo\n\n");
-  return 0;
+
+  checkDedup ();
+  checkSnapshots ();
+  checkSparse ();
+  checkStats ();
+  checkTrace ();
+  checkShared ();
+  checkReadMap ();
+  checkVectors ();
+  checkAsync ();
+  checkAsyncOrder ();
+  checkBatch ();
+  checkDir ();
+  checkDefrag ();
+  checkResize ();
+  checkDiscard ();
+  checkDirect ();
+  checkImage ();
+  checkInodeTable ();
+  checkClone ();
+  checkFallocate ();
+  checkWriteFile ();
+  checkStatfs ();
+  checkFsck ();
+  tfs_unmount ();
+  remove (CHECK_DISK);
+  printf ("%s\n", failures ? "checks FAILED" : "all checks passed");
+  return failures ? 1 : 0;
 }
 
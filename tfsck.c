@@ -0,0 +1,465 @@
+/* TinyFS consistency checker
+ *  Checks an unmounted disk image: the header of every block in use, the
+ *  chains and directories reachable from the root and the snapshots, the
+ *  inode table, the free block bitmap and the superblock counts. With -r
+ *  the problems that can be are repaired in place.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tinyFS.h"
+#include "tinyFS_dir.h"
+#include "tinyFS_layout.h"
+#include "bitset.h"
+
+/* Exit status, as for fsck(8) */
+#define FSCK_OK 0
+#define FSCK_REPAIRED 1
+#define FSCK_UNREPAIRED 4
+#define FSCK_FAILED 8
+
+/* Kind of each block, its type when it is in use and its header is sound */
+#define KIND_FREE 0
+#define KIND_BAD 0xff
+
+char* imageName;
+uint8_t* image;
+int nBlocks;
+uint8_t* bitmap;
+int repair = 0;
+int nThreads = 0;
+
+uint8_t kind[MAX_BLOCKS];
+/* Directory entries and chain links pointing at each block */
+int refs[MAX_BLOCKS];
+/* Chain walk that first reached each block, 0 if none has */
+int walkOf[MAX_BLOCKS];
+int walks = 0;
+/* Blocks of the file each block reached ends, holes included */
+int spanOf[MAX_BLOCKS];
+uint8_t dirty[MAX_BLOCKS];
+int files = 0, problems = 0, repaired = 0;
+
+static uint8_t* blockAt(int bNum) {
+	return image + bNum * BLOCKSIZE;
+}
+
+/* Report a problem found at block bNum. Returns 1 if the caller should
+repair it, when it can be and -r was given. */
+static int problem(int bNum, int fixable, const char* fmt, ...) {
+	va_list ap;
+	printf("block %d: ", bNum);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	problems++;
+	if (fixable && repair) {
+		printf(", repaired\n");
+		repaired++;
+		return 1;
+	}
+	printf("%s\n", fixable ? "" : " (not repairable)");
+	return 0;
+}
+
+static void entryName(char* name, uint8_t* entry) {
+	memcpy(name, entry, MAX_FILENAME_SIZE);
+	name[MAX_FILENAME_SIZE] = '\0';
+}
+
+typedef struct {
+	int lo, hi;
+} Range;
+
+/* Classify the blocks of a range, each thread takes its own */
+static void* classify(void* arg) {
+	Range* r = arg;
+	for (int bNum = r->lo; bNum < r->hi; bNum++) {
+		uint8_t* blk = blockAt(bNum);
+		if (bitset_is_set(bitmap, bNum)) {
+			// Free blocks may never have been written
+			kind[bNum] = KIND_FREE;
+		} else if (blk[1] != BLOCK_MAGIC || blk[0] < BLOCK_SUPER || blk[0] > BLOCK_ITABLE
+				|| blk[2] >= nBlocks || (blk[3] != 0 && blk[2] == 0)) {
+			kind[bNum] = KIND_BAD;
+		} else {
+			kind[bNum] = blk[0];
+		}
+	}
+	return NULL;
+}
+
+static void classifyAll(void) {
+	pthread_t threads[nThreads];
+	Range ranges[nThreads];
+	int per = (nBlocks + nThreads - 1) / nThreads;
+	for (int i = 0; i < nThreads; i++) {
+		ranges[i].lo = i * per;
+		ranges[i].hi = (i+1) * per < nBlocks ? (i+1) * per : nBlocks;
+		if (pthread_create(&threads[i], NULL, classify, &ranges[i]) != 0) {
+			classify(&ranges[i]);
+			threads[i] = 0;
+		}
+	}
+	for (int i = 0; i < nThreads; i++) {
+		if (threads[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+}
+
+/* Walk the chain starting at bNum, which the caller found sound and has
+counted. Every link must be an extent in use that this walk has not
+passed yet, a link that is not is cut off when repairing. A link already
+reached by another walk is shared, the rest of the chain was checked
+with it. Returns the blocks of the file the chain spans. */
+static int walkChain(int bNum) {
+	int chain[MAX_BLOCKS];
+	int n = 0, id = ++walks, tail = 0;
+	walkOf[bNum] = id;
+	for (int cur = bNum; cur > 0; ) {
+		chain[n++] = cur;
+		uint8_t* blk = blockAt(cur);
+		int next = blk[2];
+		const char* why = NULL;
+		if (next == 0) {
+			break;
+		} else if (walkOf[next] == id) {
+			why = "loops back";
+		} else if (kind[next] == KIND_FREE) {
+			why = "is free";
+		} else if (kind[next] != BLOCK_EXTENT) {
+			why = "is not an extent";
+		}
+		if (why) {
+			if (problem(cur, 1, "links to block %d, which %s", next, why)) {
+				blk[2] = 0;
+				blk[3] = 0;
+				dirty[cur] = 1;
+			}
+			break;
+		}
+		refs[next]++;
+		if (walkOf[next]) {
+			tail = spanOf[next];
+			break;
+		}
+		walkOf[next] = id;
+		cur = next;
+	}
+	for (int i = n-1; i >= 0; i--) {
+		tail += 1 + blockAt(chain[i])[3];
+		spanOf[chain[i]] = tail;
+	}
+	return spanOf[bNum];
+}
+
+static void checkInode(int bNum) {
+	uint8_t* blk = blockAt(bNum);
+	int idx = BLOCK_HEADER_SIZE + 1 + MAX_FILENAME_SIZE;
+	int size = ((uint32_t) blk[idx])         |
+			   ((uint32_t) blk[idx+1]) << 8  |
+			   ((uint32_t) blk[idx+2]) << 16 |
+			   ((uint32_t) blk[idx+3]) << 24;
+	int span = walkChain(bNum);
+	int need = (size <= INODE_DATA_SIZE) ? 1 : 2 + (size - INODE_DATA_SIZE - 1) / BLOCK_DATA_SIZE;
+	if (size < 0 || size > MAX_FILE_SIZE) {
+		problem(bNum, 0, "size %d is out of range", size);
+	} else if (span > need) {
+		problem(bNum, 0, "chain of %d blocks is longer than its size of %d bytes", span, size);
+	}
+}
+
+static void checkDir(int dNum, int isRoot);
+
+/* Check the file or directory an entry of block dBlock points at */
+static void checkEntry(int dBlock, uint8_t* entry, int isRoot) {
+	int addr = entry[MAX_FILENAME_SIZE];
+	if (addr == 0) {
+		return;
+	}
+	char name[MAX_FILENAME_SIZE + 1];
+	entryName(name, entry);
+	const char* why = NULL;
+	if (addr >= nBlocks) {
+		why = "is past the end of the disk";
+	} else if (kind[addr] == KIND_FREE) {
+		why = "is free";
+	} else if (kind[addr] != BLOCK_INODE) {
+		why = "is not an inode";
+	}
+	if (why) {
+		if (problem(dBlock, 1, "entry '%s' points at block %d, which %s", name, addr, why)) {
+			memset(entry, 0, ENTRY_SIZE);
+			dirty[dBlock] = 1;
+		}
+		return;
+	}
+	files += isRoot;
+	if (refs[addr]++ > 0) {
+		// Shared with a snapshot, or the snapshot of a snapshot
+		return;
+	}
+	if (dBlock == 0) {
+		checkDir(addr, 0);
+	} else {
+		checkInode(addr);
+	}
+}
+
+/* Check a directory's chain and every entry in it */
+static void checkDir(int dNum, int isRoot) {
+	uint8_t* blk = blockAt(dNum);
+	if ((blk[INODE_HEADER_SIZE-1] & TFS_FLAG_ISDIR) == 0) {
+		problem(dNum, 0, "directory is not flagged as one");
+	}
+	walkChain(dNum);
+	// A chain left broken is only followed as far as it is sound
+	uint8_t seen[MAX_BLOCKS] = {0};
+	int idx = INODE_HEADER_SIZE;
+	seen[dNum] = 1;
+	for (int cur = dNum; ; idx += ENTRY_SIZE) {
+		if (idx + ENTRY_SIZE > BLOCKSIZE) {
+			cur = blockAt(cur)[2];
+			if (cur == 0 || seen[cur] || kind[cur] != BLOCK_EXTENT) {
+				break;
+			}
+			seen[cur] = 1;
+			idx = BLOCK_HEADER_SIZE;
+		}
+		checkEntry(cur, blockAt(cur) + idx, isRoot);
+	}
+}
+
+/* Check the inode table chain and the record of every inode reached */
+static void checkTable(uint8_t* super) {
+	int table[MAX_BLOCKS];
+	int n = 0, id = ++walks;
+	const char* why = NULL;
+	int prev = 0, bNum = super[SUPER_ITABLE];
+	while (bNum > 0) {
+		if (bNum >= nBlocks) {
+			why = "is past the end of the disk";
+		} else if (walkOf[bNum]) {
+			why = "is already in use";
+		} else if (kind[bNum] != BLOCK_ITABLE) {
+			why = "is not an inode table block";
+		}
+		if (why) {
+			break;
+		}
+		walkOf[bNum] = id;
+		refs[bNum]++;
+		table[n++] = prev = bNum;
+		bNum = blockAt(bNum)[2];
+	}
+	if (why) {
+		// Mounting without a table reads the inodes instead
+		if (problem(prev, 1, "inode table links to block %d, which %s", bNum, why)) {
+			super[SUPER_FEATURES] &= ~FEATURE_ITABLE;
+			super[SUPER_ITABLE] = 0;
+			dirty[0] = 1;
+			for (int i = 0; i < n; i++) {
+				walkOf[table[i]] = 0;
+				refs[table[i]]--;
+			}
+		}
+		return;
+	}
+	for (bNum = ROOT_ADDRESS; bNum < nBlocks; bNum++) {
+		if (!walkOf[bNum] || kind[bNum] != BLOCK_INODE || bNum / ITABLE_RECORDS >= n) {
+			continue;
+		}
+		int t = table[bNum / ITABLE_RECORDS];
+		uint8_t* blk = blockAt(bNum);
+		uint8_t rec[ITABLE_RECORD_SIZE];
+		memcpy(rec, blk + BLOCK_HEADER_SIZE + 1 + MAX_FILENAME_SIZE, 4);
+		rec[4] = blk[INODE_HEADER_SIZE-1];
+		rec[5] = blk[BLOCK_HEADER_SIZE];
+		uint8_t* p = blockAt(t) + BLOCK_HEADER_SIZE + (bNum % ITABLE_RECORDS) * ITABLE_RECORD_SIZE;
+		if (memcmp(p, rec, ITABLE_RECORD_SIZE) != 0
+				&& problem(t, 1, "inode table record of block %d does not match the inode", bNum)) {
+			memcpy(p, rec, ITABLE_RECORD_SIZE);
+			dirty[t] = 1;
+		}
+	}
+}
+
+/* Blocks in use that nothing reaches are freed. They are reported with
+the chain they were lost with, orphaned inodes first. */
+static void checkBitmap(void) {
+	int owner[MAX_BLOCKS] = {0};
+	uint8_t linked[MAX_BLOCKS] = {0};
+	int bNum, next, n;
+	for (bNum = ROOT_ADDRESS; bNum < nBlocks; bNum++) {
+		if (!walkOf[bNum] && kind[bNum] != KIND_FREE && kind[bNum] != KIND_BAD) {
+			linked[blockAt(bNum)[2]] = 1;
+		}
+	}
+	for (int inodes = 1; inodes >= 0; inodes--) {
+		for (bNum = ROOT_ADDRESS; bNum < nBlocks; bNum++) {
+			if (walkOf[bNum] || owner[bNum] || kind[bNum] == KIND_FREE
+					|| (inodes ? kind[bNum] != BLOCK_INODE : linked[bNum])) {
+				continue;
+			}
+			owner[bNum] = bNum;
+			for (n = 1, next = blockAt(bNum)[2]; next > 0 && next < nBlocks && !walkOf[next]
+					&& !owner[next] && kind[next] == BLOCK_EXTENT; next = blockAt(next)[2], n++) {
+				owner[next] = bNum;
+			}
+			char name[MAX_FILENAME_SIZE + 1];
+			entryName(name, blockAt(bNum) + BLOCK_HEADER_SIZE + 1);
+			if (inodes) {
+				problem(bNum, 1, "orphaned inode '%s' of %d blocks", name, n);
+			} else {
+				problem(bNum, 1, "lost chain of %d blocks starts here", n);
+			}
+		}
+	}
+	for (bNum = 0; bNum < MAX_BLOCKS; bNum++) {
+		int used = bitset_is_clear(bitmap, bNum);
+		if (bNum >= nBlocks || bNum == 0) {
+			// Only the blocks of the disk past the superblock can be free
+			if (bNum >= nBlocks && !used && problem(0, 1, "block %d past the end of the disk is marked free", bNum)) {
+				bitset_clear(bitmap, bNum);
+				dirty[0] = 1;
+			} else if (bNum == 0 && !used && problem(0, 1, "superblock is marked free")) {
+				bitset_clear(bitmap, bNum);
+				dirty[0] = 1;
+			}
+			continue;
+		}
+		if (!used || walkOf[bNum]) {
+			continue;
+		}
+		if (owner[bNum] || problem(bNum, 1, "is in use but not reached from any directory")) {
+			if (repair) {
+				bitset_set(bitmap, bNum);
+				dirty[0] = 1;
+			}
+		}
+	}
+	for (bNum = 0; bNum < nBlocks; bNum++) {
+		if (refs[bNum] > UCHAR_MAX) {
+			problem(bNum, 0, "has %d references, more than can be counted", refs[bNum]);
+		}
+	}
+}
+
+static void checkCounters(uint8_t* super) {
+	if ((super[SUPER_FEATURES] & FEATURE_COUNTERS) == 0) {
+		return;
+	}
+	int nFree = bitset_popcnt(bitmap, nBlocks);
+	if (super[SUPER_FREE] != nFree
+			&& problem(0, 1, "free block count is %d, the bitmap has %d", super[SUPER_FREE], nFree)) {
+		super[SUPER_FREE] = nFree;
+		dirty[0] = 1;
+	}
+	if (super[SUPER_FILES] != files
+			&& problem(0, 1, "file count is %d, the root directory has %d", super[SUPER_FILES], files)) {
+		super[SUPER_FILES] = files;
+		dirty[0] = 1;
+	}
+}
+
+static int writeBack(void) {
+	FILE* f = fopen(imageName, "r+b");
+	if (f == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	for (int bNum = 0; bNum < nBlocks; bNum++) {
+		if (dirty[bNum] && (fseek(f, (long) bNum * BLOCKSIZE, SEEK_SET) != 0
+				|| fwrite(blockAt(bNum), BLOCKSIZE, 1, f) != 1)) {
+			perror("fwrite");
+			fclose(f);
+			return -1;
+		}
+	}
+	return fclose(f);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "rj:")) != -1) {
+		switch (opt) {
+			case 'r':
+				repair = 1;
+				break;
+			case 'j':
+				nThreads = atoi(optarg);
+				break;
+			default:
+				optind = argc;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-r] [-j threads] image\n", argv[0]);
+		return FSCK_FAILED;
+	}
+	imageName = argv[optind];
+	FILE* in = fopen(imageName, "rb");
+	if (in == NULL) {
+		perror("fopen");
+		return FSCK_FAILED;
+	}
+	image = calloc(MAX_BLOCKS, BLOCKSIZE);
+	int have = fread(image, BLOCKSIZE, MAX_BLOCKS, in);
+	fclose(in);
+	uint8_t* super = blockAt(0);
+	nBlocks = super[4];
+	bitmap = super + 5;
+	if (have < 1 || super[0] != BLOCK_SUPER || super[1] != BLOCK_MAGIC || super[2] != ROOT_ADDRESS) {
+		fprintf(stderr, "%s: bad superblock\n", imageName);
+		return FSCK_UNREPAIRED;
+	} else if (nBlocks <= ROOT_ADDRESS || have < nBlocks) {
+		fprintf(stderr, "%s: image of %d blocks, the superblock says %d\n", imageName, have, nBlocks);
+		return FSCK_UNREPAIRED;
+	}
+	if (nThreads <= 0) {
+		nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nThreads > nBlocks) {
+		nThreads = nBlocks;
+	} else if (nThreads <= 0) {
+		nThreads = 1;
+	}
+
+	// Blocks with bad headers are reported by whatever points at them, or
+	// freed if nothing does
+	classifyAll();
+	walkOf[0] = ++walks;
+	if (kind[ROOT_ADDRESS] != BLOCK_INODE) {
+		problem(ROOT_ADDRESS, 0, "root directory is not an inode");
+		return FSCK_UNREPAIRED;
+	}
+	refs[ROOT_ADDRESS] = 1;
+	checkDir(ROOT_ADDRESS, 1);
+	for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+		checkEntry(0, super + SUPER_SNAPSHOTS + i * ENTRY_SIZE, 0);
+	}
+	if (super[SUPER_FEATURES] & FEATURE_ITABLE) {
+		checkTable(super);
+	}
+	checkBitmap();
+	checkCounters(super);
+
+	if (repair && repaired > 0 && writeBack() != 0) {
+		return FSCK_FAILED;
+	}
+	printf("%s: %d blocks, %d free, %d files, %d problems (%d repaired)\n", imageName, nBlocks,
+			bitset_popcnt(bitmap, nBlocks), files, problems, repaired);
+	free(image);
+	if (problems == 0) {
+		return FSCK_OK;
+	}
+	return (problems == repaired) ? FSCK_REPAIRED : FSCK_UNREPAIRED;
+}
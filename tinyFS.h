@@ -13,5 +13,9 @@ possible values */
 #define DEFAULT_DISK_NAME "tinyFSDisk"
 /* use as a special type to keep track of files */
 typedef int fileDescriptor;
+/* tfs_mkfsFlags flag adding a packed inode table */
+#define TFS_MKFS_ITABLE 1
+/* tfs_mountFlags flag bypassing the host's page cache */
+#define TFS_MOUNT_DIRECT 1
 
 #endif
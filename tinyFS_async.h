@@ -0,0 +1,28 @@
+#ifndef TINYFS_ASYNC_H
+#define TINYFS_ASYNC_H
+
+/* Requests that can be submitted with tfs_submit */
+enum tfs_async_op {
+	/* Read len bytes at offset into buf */
+	TFS_OP_READ,
+	/* Write len bytes from buf at offset */
+	TFS_OP_WRITE,
+	/* Open the file named by buf, fd is ignored */
+	TFS_OP_OPEN,
+	TFS_OP_CLOSE,
+	TFS_OP_DELETE
+};
+
+/* Completion of a submitted request. res is what the matching call
+returned: bytes read or written, the new descriptor for TFS_OP_OPEN, 0,
+or an error code. */
+struct tfs_event {
+	int id;
+	int op;
+	int fd;
+	int res;
+	void* userData;
+};
+
+// TINYFS_ASYNC_H
+#endif
@@ -0,0 +1,39 @@
+#ifndef TINYFS_DIR_H
+#define TINYFS_DIR_H
+
+/* Longest file name, names shorter than this are NUL terminated */
+#define TFS_NAME_MAX 8
+
+/* File flags reported by tfs_stat */
+#define TFS_FLAG_ISDIR 1
+#define TFS_FLAG_WRITE 2
+#define TFS_FLAG_READ 4
+
+/* Open directory stream, see tfs_openDir */
+typedef struct tfsDir tfsDir;
+
+struct tfs_dirent {
+	char name[TFS_NAME_MAX + 1];
+	/* Block of the file's inode */
+	int inode;
+};
+
+struct tfs_stat {
+	int inode;
+	int size;
+	int flags;
+};
+
+/* Space and file counts of the mounted file system, see tfs_statfs */
+struct tfs_statfs {
+	int blockSize;
+	int blocks;
+	int freeBlocks;
+	/* Free blocks not held back by tfs_reserve */
+	int availBlocks;
+	/* Files in the root directory */
+	int files;
+};
+
+// TINYFS_DIR_H
+#endif
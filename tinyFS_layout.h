@@ -0,0 +1,64 @@
+#ifndef TINYFS_LAYOUT_H
+#define TINYFS_LAYOUT_H
+
+#include <limits.h>
+
+#include "tinyFS.h"
+
+/* On-disk layout of a TinyFS file system, shared by libTinyFS and the
+tools that read images or size their work by it */
+
+/* Every block starts with its type, BLOCK_MAGIC, the next block of its
+chain and the number of holes before that block */
+#define BLOCK_SUPER 1
+#define BLOCK_INODE 2
+#define BLOCK_EXTENT 3
+#define BLOCK_FREE 4
+#define BLOCK_ITABLE 5
+#define BLOCK_MAGIC 0x44
+
+#define FEATURE_DEDUP 1
+#define FEATURE_DISCARD 2
+#define FEATURE_ITABLE 4
+#define FEATURE_COUNTERS 8
+
+#define SUPER_ADDRESS 0
+#define ROOT_ADDRESS 1
+#define START_ADDRESS (ROOT_ADDRESS + 1)
+
+#define BLOCK_HEADER_SIZE 4
+#define MAX_FILENAME_SIZE 8
+#define INODE_HEADER_SIZE (BLOCK_HEADER_SIZE + 1 + MAX_FILENAME_SIZE + (int) sizeof(int) + 1)
+#define BLOCK_DATA_SIZE (BLOCKSIZE - BLOCK_HEADER_SIZE)
+#define INODE_DATA_SIZE (BLOCKSIZE - INODE_HEADER_SIZE)
+#define MAX_DISK_SIZE (BLOCKSIZE * (UCHAR_MAX+1))
+#define MAX_BLOCKS (UCHAR_MAX+1)
+/* Files (including holes) may span as many blocks as the largest disk */
+#define MAX_FILE_BLOCKS MAX_BLOCKS
+#define MAX_FILE_SIZE (INODE_DATA_SIZE + (MAX_FILE_BLOCKS-1) * BLOCK_DATA_SIZE)
+/* Superblock byte holding the feature flags, just past the largest bitset */
+#define SUPER_FEATURES (5 + (MAX_BLOCKS >> 3))
+/* Snapshot table, entries are laid out like directory entries */
+#define SUPER_SNAPSHOTS (SUPER_FEATURES + 1)
+#define MAX_SNAPSHOTS 8
+#define ENTRY_SIZE (MAX_FILENAME_SIZE + 1)
+/* Superblock byte holding the first block of the inode table */
+#define SUPER_ITABLE (SUPER_SNAPSHOTS + MAX_SNAPSHOTS * ENTRY_SIZE)
+/* Superblock bytes counting the free blocks and the files in the root
+directory, kept in step with the bitmap when FEATURE_COUNTERS is set */
+#define SUPER_FREE (SUPER_ITABLE + 1)
+#define SUPER_FILES (SUPER_FREE + 1)
+
+/* The inode table is a chain of BLOCK_ITABLE blocks holding a record of
+the size (4 bytes), flags and parent of the inode at each block number,
+copied from the inode's header whenever the inode is written */
+#define ITABLE_RECORD_SIZE 6
+#define ITABLE_RECORDS (BLOCK_DATA_SIZE / ITABLE_RECORD_SIZE)
+#define MAX_ITABLE_BLOCKS ((MAX_BLOCKS + ITABLE_RECORDS - 1) / ITABLE_RECORDS)
+
+/* Byte 3 of a block counts the holes between it and the next block, so
+it must be 0 at the end of a chain */
+#define IS_BAD_BLOCK(blk) ((blk)[0] > BLOCK_ITABLE || (blk)[1] != BLOCK_MAGIC || ((blk)[3] != 0 && (blk)[2] == 0))
+
+// TINYFS_LAYOUT_H
+#endif
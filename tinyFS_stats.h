@@ -0,0 +1,57 @@
+#ifndef TINYFS_STATS_H
+#define TINYFS_STATS_H
+
+/* Calls counted by tfs_stats */
+enum tfs_stat_op {
+	TFS_STAT_MKFS,
+	TFS_STAT_MOUNT,
+	TFS_STAT_UNMOUNT,
+	TFS_STAT_OPEN,
+	TFS_STAT_CLOSE,
+	TFS_STAT_WRITE_FILE,
+	TFS_STAT_WRITE,
+	TFS_STAT_TRUNCATE,
+	TFS_STAT_DELETE,
+	TFS_STAT_READ_BYTE,
+	TFS_STAT_SEEK,
+	TFS_STAT_SNAPSHOT,
+	TFS_STAT_OPEN_SNAPSHOT,
+	TFS_STAT_DELETE_SNAPSHOT,
+	TFS_STAT_READ_MAP,
+	TFS_STAT_READV,
+	TFS_STAT_WRITEV,
+	TFS_STAT_CLONE,
+	TFS_STAT_FALLOCATE,
+	TFS_STAT_RESERVE,
+	TFS_STAT_STATFS,
+	TFS_STAT_DEFRAG,
+	TFS_STAT_RESIZE,
+	TFS_STAT_RESIZE_IMAGE,
+	TFS_STAT_BATCH_BEGIN,
+	TFS_STAT_BATCH_COMMIT,
+	TFS_STAT_OPEN_DIR,
+	TFS_STAT_READ_DIR,
+	TFS_STAT_STAT,
+	TFS_STAT_NUM_OPS
+};
+
+/* Latency bucket i counts calls that took [2^i, 2^(i+1)) nanoseconds,
+the last bucket also counts anything slower */
+#define TFS_STAT_BUCKETS 32
+
+struct tfs_stats {
+	unsigned long calls[TFS_STAT_NUM_OPS];
+	unsigned long errors[TFS_STAT_NUM_OPS];
+	unsigned long latency[TFS_STAT_NUM_OPS][TFS_STAT_BUCKETS];
+	/* Blocks read from and written to the disk */
+	unsigned long blockReads, blockWrites;
+	/* Block reads served from the block cache, and reads that were not */
+	unsigned long cacheHits, cacheMisses;
+	/* File data moved by reads and writes */
+	unsigned long bytesRead, bytesWritten;
+	/* Scans of the free block bitmap */
+	unsigned long allocScans;
+};
+
+// TINYFS_STATS_H
+#endif
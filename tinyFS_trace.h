@@ -0,0 +1,43 @@
+#ifndef TINYFS_TRACE_H
+#define TINYFS_TRACE_H
+
+#include <stdint.h>
+
+#include "tinyFS_stats.h"
+
+/* A trace file is a tfs_trace_header followed by tfs_trace_records in
+the order they happened. API calls use the tfs_stat_op numbers as their
+op, block I/O is recorded with the ops below. */
+#define TFS_TRACE_MAGIC "TFST"
+#define TFS_TRACE_VERSION 4
+
+enum tfs_trace_op {
+	TFS_TRACE_READ_BLOCK = TFS_STAT_NUM_OPS,
+	TFS_TRACE_WRITE_BLOCK,
+	TFS_TRACE_NUM_OPS
+};
+
+struct tfs_trace_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t recordSize;
+};
+
+/* For API calls ns is when the call started, fd the file descriptor it
+was given (or returned, for tfs_openFile), size its size, length, offset
+or nBytes argument and ret what it returned. tfs_openFile also records
+the inode it opened as bNum, so replays can tell files apart without
+the trace holding any names, and so do tfs_clone and tfs_stat. For block I/O fd is the disk and bNum the
+block. */
+struct tfs_trace_record {
+	uint64_t ns;
+	uint8_t op;
+	uint8_t pad;
+	int16_t bNum;
+	int32_t fd;
+	int32_t size;
+	int32_t ret;
+};
+
+// TINYFS_TRACE_H
+#endif
@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "tinyFS.h"
+
+#define DEFAULT_RECORDS 4096
+
+int tfs_error(int errnum);
+
+int tracing = 0;
+
+/* Records are appended to ring and written out a ring at a time */
+int traceFD = -1;
+struct tfs_trace_record* ring = NULL;
+int ringSize = 0, ringHead = 0;
+/* Error from the last failed flush, reported by trace_stop */
+int traceErr = 0;
+
+static int flush(void) {
+	size_t len = ringHead * sizeof(*ring);
+	char* p = (char*) ring;
+	while (len > 0) {
+		ssize_t n = write(traceFD, p, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return tfs_error(errno);
+		}
+		p += n;
+		len -= n;
+	}
+	ringHead = 0;
+	return 0;
+}
+
+int trace_start(char* filename, int records) {
+	if (tracing) {
+		return ERR_AGAIN;
+	}
+	if (filename == NULL) {
+		return ERR_FAULT;
+	}
+	if (records <= 0) {
+		records = DEFAULT_RECORDS;
+	}
+	ring = malloc(records * sizeof(*ring));
+	if (ring == NULL) {
+		return ERR_NOMEMORY;
+	}
+	traceFD = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (traceFD == -1) {
+		free(ring);
+		ring = NULL;
+		return tfs_error(errno);
+	}
+	struct tfs_trace_header hdr = {TFS_TRACE_MAGIC, TFS_TRACE_VERSION, sizeof(*ring)};
+	if (write(traceFD, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		int err = tfs_error(errno);
+		close(traceFD);
+		free(ring);
+		ring = NULL;
+		return err;
+	}
+	ringSize = records;
+	ringHead = 0;
+	traceErr = 0;
+	tracing = 1;
+	return 0;
+}
+
+int trace_stop(void) {
+	if (!tracing) {
+		return ERR_INVALID;
+	}
+	tracing = 0;
+	int err = flush();
+	if (close(traceFD) == -1 && err == 0) {
+		err = tfs_error(errno);
+	}
+	free(ring);
+	ring = NULL;
+	traceFD = -1;
+	return traceErr ? traceErr : err;
+}
+
+uint64_t trace_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_record(int op, uint64_t ns, int bNum, int fd, int size, int ret) {
+	if (ringHead == ringSize) {
+		int err = flush();
+		if (err < 0) {
+			// Keep tracing into the ring, the loss is reported on stop
+			traceErr = err;
+			ringHead = 0;
+		}
+	}
+	struct tfs_trace_record* r = &ring[ringHead++];
+	r->ns = ns;
+	r->op = op;
+	r->pad = 0;
+	r->bNum = bNum;
+	r->fd = fd;
+	r->size = size;
+	r->ret = ret;
+}
@@ -0,0 +1,25 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "tinyFS_trace.h"
+
+/* Nonzero while a trace is being captured, checked before recording so
+an idle trace costs a single branch */
+extern int tracing;
+
+int trace_start(char* filename, int records);
+int trace_stop(void);
+
+uint64_t trace_now(void);
+void trace_record(int op, uint64_t ns, int bNum, int fd, int size, int ret);
+
+#define trace(op, ns, bNum, fd, size, ret) do { \
+	if (tracing) { \
+		trace_record(op, ns, bNum, fd, size, ret); \
+	} \
+} while (0)
+
+//TRACE_H
+#endif